@@ -1,24 +1,29 @@
 #include <NIDAQmx.h>
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
-const float64 kCameraFps = 100.0;      // Hz
-const float64 kPulseDutyCycle = 0.25;  // 25% duty cycle
-
-/**
- * @brief Handles error from NI-DAQmx functions.
- *
- * @param err NI-DAQmx error code.
- */
-inline void HandleError(int error) {
-    if (error == 0)
-        return;
-
-    char errorMessage[1024];
-    DAQmxGetErrorString(error, errorMessage, 1024);
-    std::cout << errorMessage << std::endl;
-}
+#include "../common/perf_counters.cpp"
+#include "camera_trigger.cpp"
+#include "exposure_feedback.cpp"
+#include "frame_burst.cpp"
+#include "trial_gate.cpp"
+
+enum class TriggerMode {
+    Continuous,  // Pulses from start until the user presses enter
+    Gated,       // Continuous, paused between trials by the trial gate; requires Dev2/port1/line0 (PFI0) wired to PFI1
+    Burst        // kFramesPerTrial pulses on every rising edge of kTrialStartTerminal
+};
+
+const TriggerMode kTriggerMode = TriggerMode::Continuous;
+const uInt64 kFramesPerTrial = 500;
+const bool kPerfCounters = false;      // Sample perf counters around each poll of the monitor thread; reported at exit
+const bool kExposureFeedback = false;  // Measure each camera's strobe against the trigger; uses ctr2 and ctr3
 
 int main() {
     // Create counter output task; ctr0 corresponds to terminal PFI12
@@ -28,14 +33,78 @@ int main() {
                                            kCameraFps, kPulseDutyCycle));
     DAQmxCfgImplicitTiming(counterTaskHandle, DAQmx_Val_ContSamps, 1000);
 
+    // Optionally gate the pulses in hardware between trials, or generate a retriggerable burst per trial
+    std::unique_ptr<TrialGate> gate;
+    std::unique_ptr<FrameCounter> frameCounter;
+    if (kTriggerMode == TriggerMode::Gated) {
+        ConfigurePauseTrigger(counterTaskHandle);
+        gate = std::make_unique<TrialGate>();
+    } else if (kTriggerMode == TriggerMode::Burst) {
+        ConfigureFrameBurst(counterTaskHandle, kFramesPerTrial);
+        frameCounter = std::make_unique<FrameCounter>(kFramesPerTrial);
+        frameCounter->Start();
+    }
+
+    // Optionally capture each camera's strobe; started before the triggers so that the first frame is measured. Off by
+    // default, since the monitors take two counters and need the strobes wired back (see kExposureCameras).
+    std::vector<std::unique_ptr<ExposureMonitor>> monitors;
+    if (kExposureFeedback) {
+        for (const ExposureCamera &camera : kExposureCameras) {
+            monitors.push_back(std::make_unique<ExposureMonitor>(camera));
+            monitors.back()->Start();
+        }
+    }
+
     // Start counter output task
     HandleError(DAQmxStartTask(counterTaskHandle));
 
-    // Wait for user input; pulses continue until user presses enter
-    std::getchar();
+    // Update latency histograms and per-trial frame counts while recording
+    std::atomic<bool> keepMonitoring(true);
+    StageMetrics metrics("monitor");
+    StageMetrics *monitorMetrics = kPerfCounters ? &metrics : NULL;
+    std::thread monitorThread([&]() {
+        while (keepMonitoring) {
+            {
+                PerfStageScope stage(monitorMetrics, "exposurePoll");
+                for (auto &monitor : monitors)
+                    monitor->Poll();
+            }
+            if (frameCounter) {
+                PerfStageScope stage(monitorMetrics, "frameCountPoll");
+                frameCounter->Poll();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    });
+
+    // Wait for user input; pulses continue until user presses enter. With the trial gate, "o" + enter opens the gate
+    // (trial start) and "c" + enter closes it (trial end).
+    if (gate)
+        gate->Open();
+    std::string command;
+    while (std::getline(std::cin, command) && !command.empty()) {
+        if (gate && command == "o")
+            gate->Open();
+        else if (gate && command == "c")
+            gate->Close();
+    }
+    if (gate)
+        gate->Close();
 
     // Stop task
     HandleError(DAQmxStopTask(counterTaskHandle));
 
+    keepMonitoring = false;
+    monitorThread.join();
+    for (auto &monitor : monitors) {
+        monitor->Poll();
+        monitor->Stop();
+        monitor->PrintSummary();
+    }
+    if (frameCounter)
+        frameCounter->Finish();
+    if (monitorMetrics)
+        monitorMetrics->report(std::cout);
+
     return 0;
 }
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <iostream>
+
+const float64 kCameraFps = 100.0;      // Hz
+const float64 kPulseDutyCycle = 0.25;  // 25% duty cycle
+
+/**
+ * @brief Handles error from NI-DAQmx functions.
+ *
+ * @param err NI-DAQmx error code.
+ */
+inline void HandleError(int error) {
+    if (error == 0)
+        return;
+
+    char errorMessage[1024];
+    DAQmxGetErrorString(error, errorMessage, 1024);
+    std::cout << errorMessage << std::endl;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "camera_trigger.cpp"
+
+const float64 kLatencyBinWidth = 10e-6;    // s; histogram resolution
+const int kLatencyBins = 1000;             // Histogram covers 0 to 10 ms; longer latencies land in the last bin
+const float64 kLatencyWarning = 2e-3;      // s; warn when a single trigger→exposure latency exceeds this
+const int kExposureBufferSize = 10000;     // Samples buffered per camera between reads
+
+/**
+ * @brief A camera whose strobe (exposure active) output is wired back to the DAQ.
+ */
+struct ExposureCamera {
+    const char *name;
+    const char *counter;         // Spare counter measuring trigger→strobe latency
+    const char *strobeTerminal;  // PFI the camera strobe is wired to
+};
+
+// ctr0 generates the triggers; ctr2/ctr3 are spare on the PCIe-6321
+const ExposureCamera kExposureCameras[] = {
+    {"cam0", "Dev2/ctr2", "/Dev2/PFI4"},
+    {"cam1", "Dev2/ctr3", "/Dev2/PFI5"},
+};
+
+/**
+ * @brief Online histogram and running statistics of trigger→exposure latencies for one camera.
+ */
+class LatencyHistogram {
+   public:
+    LatencyHistogram() : bins_(kLatencyBins, 0) {}
+
+    /**
+     * @brief Adds one latency measurement.
+     *
+     * A measurement longer than a trigger period means the camera ignored at least one trigger, since the counter
+     * pairs each trigger with the next strobe; those are counted as skipped frames instead of latencies.
+     *
+     * @param latency s
+     * @return true if the camera lagged beyond kLatencyWarning or skipped a frame
+     */
+    bool Add(float64 latency) {
+        const float64 period = 1.0 / kCameraFps;
+        bool skipped = latency >= period;
+        if (skipped) {
+            skipped_ += uint64_t(latency / period);
+            latency = std::fmod(latency, period);
+        }
+
+        // Welford's running mean/variance; the standard deviation is the jitter
+        count_++;
+        float64 delta = latency - mean_;
+        mean_ += delta / count_;
+        m2_ += delta * (latency - mean_);
+        min_ = std::min(min_, latency);
+        max_ = std::max(max_, latency);
+
+        int bin = std::min(int(latency / kLatencyBinWidth), kLatencyBins - 1);
+        bins_[bin]++;
+
+        return skipped || latency > kLatencyWarning;
+    }
+
+    /**
+     * @brief Latency below which a fraction q of the measurements fall, at histogram resolution.
+     */
+    float64 Quantile(float64 q) const {
+        uint64_t target = uint64_t(std::ceil(q * count_));
+        uint64_t seen = 0;
+        for (int i = 0; i < kLatencyBins; i++) {
+            seen += bins_[i];
+            if (seen >= target && seen > 0)
+                return (i + 1) * kLatencyBinWidth;
+        }
+        return kLatencyBins * kLatencyBinWidth;
+    }
+
+    uint64_t Count() const { return count_; }
+    uint64_t Skipped() const { return skipped_; }
+    float64 Mean() const { return mean_; }
+    float64 Jitter() const { return count_ > 1 ? std::sqrt(m2_ / (count_ - 1)) : 0.0; }
+    float64 Min() const { return min_; }
+    float64 Max() const { return max_; }
+
+   private:
+    std::vector<uint64_t> bins_;
+    uint64_t count_ = 0;
+    uint64_t skipped_ = 0;
+    float64 mean_ = 0;
+    float64 m2_ = 0;
+    float64 min_ = INFINITY;
+    float64 max_ = 0;
+};
+
+/**
+ * @brief Captures buffered trigger→exposure latencies of one camera with a two-edge separation counter.
+ *
+ * The first edge is the trigger pulse of ctr0 (routed internally) and the second edge is the rising edge of the
+ * camera's strobe, so every sample is one frame's latency, timestamped by the counter timebase.
+ */
+class ExposureMonitor {
+   public:
+    explicit ExposureMonitor(const ExposureCamera &camera) : camera_(camera), buffer_(kExposureBufferSize) {
+        std::string taskName = std::string("exposure_") + camera.name;
+        HandleError(DAQmxCreateTask(taskName.c_str(), &task_));
+        HandleError(DAQmxCreateCITwoEdgeSepChan(task_, camera.counter, camera.name, 1e-7, 1.0, DAQmx_Val_Seconds,
+                                                DAQmx_Val_Rising, DAQmx_Val_Rising, NULL));
+        HandleError(DAQmxSetCITwoEdgeSepFirstTerm(task_, camera.name, "/Dev2/Ctr0InternalOutput"));
+        HandleError(DAQmxSetCITwoEdgeSepSecondTerm(task_, camera.name, camera.strobeTerminal));
+        HandleError(DAQmxCfgImplicitTiming(task_, DAQmx_Val_ContSamps, kExposureBufferSize));
+    }
+
+    ~ExposureMonitor() { DAQmxClearTask(task_); }
+
+    ExposureMonitor(const ExposureMonitor &) = delete;
+    ExposureMonitor &operator=(const ExposureMonitor &) = delete;
+
+    /**
+     * @brief Starts capturing; call before the trigger task starts so that no frame is missed.
+     */
+    void Start() { HandleError(DAQmxStartTask(task_)); }
+
+    void Stop() { HandleError(DAQmxStopTask(task_)); }
+
+    /**
+     * @brief Reads all buffered latencies without blocking and adds them to the histogram.
+     *
+     * Prints a warning for each frame that lagged or was skipped.
+     */
+    void Poll() {
+        int32 read = 0;
+        HandleError(DAQmxReadCounterF64(task_, -1, 0.0, buffer_.data(), kExposureBufferSize, &read, NULL));
+        for (int32 i = 0; i < read; i++) {
+            uint64_t skippedBefore = histogram_.Skipped();
+            if (histogram_.Add(buffer_[i])) {
+                std::cout << camera_.name << ": frame " << histogram_.Count() << " latency " << buffer_[i] * 1e6
+                          << " us";
+                if (histogram_.Skipped() != skippedBefore)
+                    std::cout << " (" << histogram_.Skipped() - skippedBefore << " skipped)";
+                std::cout << std::endl;
+            }
+        }
+    }
+
+    /**
+     * @brief Prints latency and jitter statistics.
+     */
+    void PrintSummary() const {
+        std::cout << std::fixed << std::setprecision(1) << camera_.name << ": " << histogram_.Count()
+                  << " frames, " << histogram_.Skipped() << " skipped, latency mean " << histogram_.Mean() * 1e6
+                  << " us, jitter " << histogram_.Jitter() * 1e6 << " us, min " << histogram_.Min() * 1e6
+                  << " us, p50 " << histogram_.Quantile(0.5) * 1e6 << " us, p99 " << histogram_.Quantile(0.99) * 1e6
+                  << " us, max " << histogram_.Max() * 1e6 << " us" << std::endl;
+    }
+
+    const LatencyHistogram &Histogram() const { return histogram_; }
+
+   private:
+    ExposureCamera camera_;
+    TaskHandle task_;
+    std::vector<float64> buffer_;
+    LatencyHistogram histogram_;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "camera_trigger.cpp"
+
+// Rising edges on kTrialStartTerminal start a trial. In burst mode ctr1 counts frames, so it cannot also be the
+// device clock of trial_gate.cpp.
+const char *const kTrialStartTerminal = "/Dev2/PFI2";
+const char *const kFrameCounter = "Dev2/ctr1";
+const char *const kFrameCounterSource = "/Dev2/Ctr0InternalOutput";
+const int kFrameCountBufferSize = 1000;  // Trial starts buffered between reads
+
+/**
+ * @brief Makes the counter output task generate exactly framesPerTrial pulses on every trial-start edge.
+ *
+ * The start trigger is retriggerable, so the hardware re-arms after each burst without host involvement.
+ *
+ * @param counterTaskHandle camera trigger task; must not be running
+ * @param framesPerTrial pulses per burst
+ */
+inline void ConfigureFrameBurst(TaskHandle counterTaskHandle, uInt64 framesPerTrial) {
+    HandleError(DAQmxCfgImplicitTiming(counterTaskHandle, DAQmx_Val_FiniteSamps, framesPerTrial));
+    HandleError(DAQmxCfgDigEdgeStartTrig(counterTaskHandle, kTrialStartTerminal, DAQmx_Val_Rising));
+    HandleError(DAQmxSetStartTrigRetriggerable(counterTaskHandle, true));
+}
+
+/**
+ * @brief Confirms the number of frames triggered in each trial.
+ *
+ * A counter input counts the trigger pulses and is sampled in hardware on every trial-start edge, so each buffered
+ * sample is the cumulative frame count at the start of a trial; consecutive differences are the frames per trial.
+ */
+class FrameCounter {
+   public:
+    explicit FrameCounter(uInt64 framesPerTrial) : framesPerTrial_(framesPerTrial), buffer_(kFrameCountBufferSize) {
+        HandleError(DAQmxCreateTask("frame_counter", &task_));
+        HandleError(DAQmxCreateCICountEdgesChan(task_, kFrameCounter, "frames", DAQmx_Val_Rising, 0, DAQmx_Val_CountUp));
+        HandleError(DAQmxSetCICountEdgesTerm(task_, "frames", kFrameCounterSource));
+        HandleError(DAQmxCfgSampClkTiming(task_, kTrialStartTerminal, 1000.0, DAQmx_Val_Rising, DAQmx_Val_ContSamps,
+                                          kFrameCountBufferSize));
+    }
+
+    ~FrameCounter() { DAQmxClearTask(task_); }
+
+    FrameCounter(const FrameCounter &) = delete;
+    FrameCounter &operator=(const FrameCounter &) = delete;
+
+    /**
+     * @brief Starts counting; call before the trigger task starts.
+     */
+    void Start() { HandleError(DAQmxStartTask(task_)); }
+
+    /**
+     * @brief Reads the counts latched at new trial starts and checks every trial that has completed.
+     */
+    void Poll() {
+        int32 read = 0;
+        HandleError(DAQmxReadCounterU32(task_, -1, 0.0, buffer_.data(), kFrameCountBufferSize, &read, NULL));
+        for (int32 i = 0; i < read; i++) {
+            if (trials_ > 0)
+                Check(buffer_[i] - lastCount_);
+            lastCount_ = buffer_[i];
+            trials_++;
+        }
+    }
+
+    /**
+     * @brief Checks the last trial against the current count, then stops counting.
+     */
+    void Finish() {
+        Poll();
+        if (trials_ > 0) {
+            uInt32 count = 0;
+            HandleError(DAQmxGetCICount(task_, "frames", &count));
+            Check(count - lastCount_);
+        }
+        HandleError(DAQmxStopTask(task_));
+        std::cout << trials_ << " trials, " << mismatches_ << " with a frame count other than " << framesPerTrial_
+                  << std::endl;
+    }
+
+   private:
+    void Check(uInt32 frames) {
+        if (frames != framesPerTrial_) {
+            mismatches_++;
+            std::cout << "Trial " << trials_ - 1 << ": " << frames << " frames, expected " << framesPerTrial_
+                      << std::endl;
+        }
+    }
+
+    uInt64 framesPerTrial_;
+    TaskHandle task_;
+    std::vector<uInt32> buffer_;
+    uInt32 lastCount_ = 0;
+    uint64_t trials_ = 0;
+    uint64_t mismatches_ = 0;
+};
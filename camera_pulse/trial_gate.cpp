@@ -0,0 +1,156 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "camera_trigger.cpp"
+
+// The host drives kGateLine, which is physically wired to kGateTerminal, the pause trigger source of the trigger task.
+// PFI0 and PFI1 are port1/line0 and port1/line1 on the PCIe-6321.
+const char *const kGateLine = "Dev2/port1/line0";
+const char *const kGateTerminal = "/Dev2/PFI1";
+const char *const kDeviceClockCounter = "Dev2/ctr1";
+const char *const kDeviceClockTimebase = "/Dev2/100kHzTimebase";
+const float64 kDeviceClockRate = 100e3;  // Hz
+const uInt32 kEdgeBufferSize = 1024;  // Latched gate edges buffered on the device until logged
+const float64 kMaxSemiPeriodTicks = 4294967295.0;  // 32-bit counter; a trial or a pause may last up to ~11.9 h
+
+/**
+ * @brief Pauses the counter output task while kGateTerminal is LOW.
+ *
+ * The counter holds its count while paused, so when the gate opens the pulse train continues where it stopped instead
+ * of restarting; no task start/stop is needed between trials.
+ *
+ * @param counterTaskHandle camera trigger task; must not be running
+ */
+inline void ConfigurePauseTrigger(TaskHandle counterTaskHandle) {
+    HandleError(DAQmxSetPauseTrigType(counterTaskHandle, DAQmx_Val_DigLvl));
+    HandleError(DAQmxSetDigLvlPauseTrigSrc(counterTaskHandle, kGateTerminal));
+    HandleError(DAQmxSetDigLvlPauseTrigWhen(counterTaskHandle, DAQmx_Val_Low));
+}
+
+/**
+ * @brief A trial boundary, i.e. the gate opening (trial start) or closing (trial end).
+ */
+struct TrialBoundary {
+    uint64_t trial;
+    bool open;
+    float64 deviceTime;  // s; gate edge latched on the device clock, since the first trial start
+    uint64_t hostTimeUs;  // us; steady_clock
+};
+
+/**
+ * @brief Host API to open/close the hardware gate of the camera trigger task between trials.
+ *
+ * Trial boundaries are logged against a device clock that the gate edges latch in hardware. A spare counter measures
+ * the semi-periods of kGateTerminal in ticks of the 100 kHz timebase, that is the time between consecutive edges,
+ * starting at the first rising edge (the first trial start). The time of each later edge is the sum of the
+ * semi-periods up to it, so it carries no software latency of the write or the read.
+ */
+class TrialGate {
+   public:
+    TrialGate() {
+        HandleError(DAQmxCreateTask("trial_gate", &gateTask_));
+        HandleError(DAQmxCreateDOChan(gateTask_, kGateLine, "gate", DAQmx_Val_ChanForAllLines));
+
+        HandleError(DAQmxCreateTask("device_clock", &clockTask_));
+        HandleError(DAQmxCreateCISemiPeriodChan(clockTask_, kDeviceClockCounter, "clock", 2, kMaxSemiPeriodTicks,
+                                                DAQmx_Val_Ticks, NULL));
+        HandleError(DAQmxSetCISemiPeriodTerm(clockTask_, "clock", kGateTerminal));
+        HandleError(DAQmxSetCISemiPeriodStartingEdge(clockTask_, "clock", DAQmx_Val_Rising));
+        HandleError(DAQmxSetCICtrTimebaseSrc(clockTask_, "clock", kDeviceClockTimebase));
+        HandleError(DAQmxCfgImplicitTiming(clockTask_, DAQmx_Val_ContSamps, kEdgeBufferSize));
+        HandleError(DAQmxStartTask(clockTask_));
+
+        // Trigger task starts paused; also makes subsequent writes faster
+        WriteGate(0);
+    }
+
+    ~TrialGate() {
+        DAQmxClearTask(gateTask_);
+        DAQmxClearTask(clockTask_);
+    }
+
+    TrialGate(const TrialGate &) = delete;
+    TrialGate &operator=(const TrialGate &) = delete;
+
+    /**
+     * @brief Opens the gate; camera triggers resume immediately.
+     */
+    void Open() {
+        if (isOpen_)
+            return;
+        WriteGate(1);
+        isOpen_ = true;
+        Log(true);
+    }
+
+    /**
+     * @brief Closes the gate; camera triggers pause until the next Open().
+     */
+    void Close() {
+        if (!isOpen_)
+            return;
+        WriteGate(0);
+        isOpen_ = false;
+        Log(false);
+        trial_++;
+    }
+
+    bool IsOpen() const { return isOpen_; }
+
+    const std::vector<TrialBoundary> &Boundaries() const { return boundaries_; }
+
+   private:
+    /**
+     * @brief Device time of the gate edge just written.
+     *
+     * The first rising edge starts the semi-period measurement and is time 0; every later edge ends a semi-period,
+     * whose latched length is available as soon as the edge has happened.
+     *
+     * @return float64 s since the first trial start
+     */
+    float64 EdgeTime() {
+        if (!clockStarted_) {
+            clockStarted_ = true;
+            return 0.0;
+        }
+        uInt32 semiPeriod = 0;
+        HandleError(DAQmxReadCounterU32(clockTask_, 1, 1.0, &semiPeriod, 1, NULL, NULL));
+        ticks_ += semiPeriod;
+        return ticks_ / kDeviceClockRate;
+    }
+
+    void WriteGate(uInt8 level) {
+        uInt8 data[1] = {level};
+        HandleError(DAQmxWriteDigitalLines(gateTask_, 1, true, 1, DAQmx_Val_GroupByChannel, data, NULL, NULL));
+    }
+
+    void Log(bool open) {
+        TrialBoundary boundary;
+        boundary.trial = trial_;
+        boundary.open = open;
+        boundary.deviceTime = EdgeTime();
+        boundary.hostTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now().time_since_epoch())
+                                  .count();
+        boundaries_.push_back(boundary);
+
+        std::cout << std::fixed << std::setprecision(5) << "Trial " << boundary.trial
+                  << (open ? " start" : " end") << ": device " << boundary.deviceTime << " s, host "
+                  << boundary.hostTimeUs << " us" << std::endl;
+    }
+
+    TaskHandle gateTask_;
+    TaskHandle clockTask_;
+    bool isOpen_ = false;
+    uint64_t trial_ = 0;
+    bool clockStarted_ = false;  // The first rising edge has started the semi-period measurement
+    uint64_t ticks_ = 0;         // Sum of the semi-periods read so far
+    std::vector<TrialBoundary> boundaries_;
+};
@@ -0,0 +1,329 @@
+#pragma once
+
+/**
+ * Optional hardware/software performance counters per stage of a loop (Linux perf_event_open).
+ *
+ * A StageMetrics samples cycles, instructions, cache misses, context switches and page faults of the calling thread
+ * around each stage, so latency outliers can be attributed to cache misses, preemption or time in the driver.
+ * Counters that the kernel or the CPU does not provide (e.g. hardware counters in a VM, or perf_event_paranoid) read
+ * as zero. Counters include kernel mode if perf_event_paranoid <= 1 (or with CAP_PERFMON), and count user mode only
+ * otherwise; context switches, which only happen in the kernel, are then taken from getrusage instead.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Opens a perf counter for the calling thread.
+ *
+ * The counter includes kernel mode if allowed. At the default perf_event_paranoid of 2, an unprivileged process may
+ * only count user mode, so the counter is opened again for user mode only.
+ *
+ * @param type PERF_TYPE_*
+ * @param config event of that type
+ * @param groupFd leader of the group to join, or -1
+ * @param readFormat PERF_FORMAT_* flags
+ * @param countsKernel if not NULL, set to whether the counter includes kernel mode
+ * @return int file descriptor, or -1 if the counter is unavailable
+ */
+inline int openThreadPerfCounter(uint32_t type, uint64_t config, int groupFd = -1, uint64_t readFormat = 0,
+                                 bool *countsKernel = NULL)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_hv = 1;
+    attr.read_format = readFormat;
+    int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+    if (fd < 0)
+    {
+        attr.exclude_kernel = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+    }
+    if (countsKernel != NULL)
+        *countsKernel = fd >= 0 && !attr.exclude_kernel;
+    return fd;
+}
+
+/**
+ * @brief Voluntary and involuntary context switches of the calling thread so far; needs no perf permissions.
+ */
+inline uint64_t threadContextSwitches()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) != 0)
+        return 0;
+    return uint64_t(usage.ru_nvcsw) + uint64_t(usage.ru_nivcsw);
+}
+
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_PAGE_FAULTS,
+    NUM_PERF_COUNTERS
+};
+
+const char *const PERF_COUNTER_NAMES[NUM_PERF_COUNTERS] = {"cycles", "instructions", "cacheMisses",
+                                                           "contextSwitches", "pageFaults"};
+
+/**
+ * @brief The five counters of one thread, read together with a single syscall.
+ */
+class PerfCounterGroup
+{
+public:
+    struct Sample
+    {
+        uint64_t values[NUM_PERF_COUNTERS] = {};
+    };
+
+    /**
+     * @brief Opens the counters for the calling thread.
+     */
+    PerfCounterGroup()
+    {
+        const uint32_t types[NUM_PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                   PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE};
+        const uint64_t configs[NUM_PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                     PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES,
+                                                     PERF_COUNT_SW_PAGE_FAULTS};
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            bool countsKernel = false;
+            int fd = openThreadPerfCounter(types[i], configs[i], leaderFd_, PERF_FORMAT_GROUP, &countsKernel);
+            if (fd < 0)
+                continue;
+            countsKernel_ = countsKernel_ && countsKernel;
+            if (i == PERF_CONTEXT_SWITCHES && !countsKernel)
+            {
+                // A user-mode context switch counter opens, but never counts
+                close(fd);
+                rusageContextSwitches_ = true;
+                continue;
+            }
+            if (leaderFd_ < 0)
+                leaderFd_ = fd;
+            else
+                memberFds_.push_back(fd);
+            counters_.push_back(PerfCounter(i));
+        }
+    }
+
+    ~PerfCounterGroup()
+    {
+        for (int fd : memberFds_)
+            close(fd);
+        if (leaderFd_ >= 0)
+            close(leaderFd_);
+    }
+
+    PerfCounterGroup(const PerfCounterGroup &) = delete;
+    PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+    /**
+     * @brief Reads all counters.
+     */
+    Sample read() const
+    {
+        Sample sample;
+        if (rusageContextSwitches_)
+            sample.values[PERF_CONTEXT_SWITCHES] = threadContextSwitches();
+        if (leaderFd_ < 0)
+            return sample;
+
+        // PERF_FORMAT_GROUP: number of counters, then their values in the order they joined the group
+        uint64_t buffer[1 + NUM_PERF_COUNTERS];
+        if (::read(leaderFd_, buffer, sizeof(buffer)) <= 0)
+            return sample;
+        for (size_t i = 0; i < counters_.size() && i < buffer[0]; i++)
+        {
+            sample.values[counters_[i]] = buffer[1 + i];
+        }
+        return sample;
+    }
+
+    /**
+     * @return true if the counter could be opened (or context switches are taken from getrusage)
+     */
+    bool available(PerfCounter counter) const
+    {
+        return (counter == PERF_CONTEXT_SWITCHES && rusageContextSwitches_) ||
+               std::find(counters_.begin(), counters_.end(), counter) != counters_.end();
+    }
+
+    /**
+     * @return false if some counters could only be opened for user mode
+     */
+    bool countsKernel() const { return countsKernel_; }
+
+private:
+    int leaderFd_ = -1;
+    std::vector<int> memberFds_;
+    std::vector<PerfCounter> counters_;
+    bool countsKernel_ = true;
+    bool rusageContextSwitches_ = false; // Context switches from getrusage; no kernel-mode counter was allowed
+};
+
+/**
+ * @brief Per-stage aggregation of perf counters and wall time for one thread.
+ *
+ * The counters are opened on the first sample, so the StageMetrics must be sampled from the thread being measured.
+ * Optionally, every sample is also written as a CSV line to a trace stream.
+ */
+class StageMetrics
+{
+public:
+    /**
+     * @param name name printed in the report
+     */
+    explicit StageMetrics(std::string name) : name_(std::move(name)) { stages_.reserve(16); }
+
+    /**
+     * @brief Writes every sample as "stage,ns,cycles,instructions,cacheMisses,contextSwitches,pageFaults".
+     *
+     * @param trace stream to write to, or NULL to disable; must outlive the StageMetrics
+     */
+    void setTrace(std::ostream *trace) { trace_ = trace; }
+
+    /**
+     * @brief Reads the counters at the start of a stage.
+     */
+    PerfCounterGroup::Sample begin()
+    {
+        if (!group_)
+            group_.reset(new PerfCounterGroup());
+        return group_->read();
+    }
+
+    /**
+     * @brief Reads the counters at the end of a stage and adds the difference to that stage.
+     *
+     * @param stage stage name; a string literal, compared by content
+     * @param start sample returned by begin()
+     * @param ns wall time of the stage
+     */
+    void end(const char *stage, const PerfCounterGroup::Sample &start, uint64_t ns)
+    {
+        PerfCounterGroup::Sample stop = group_->read();
+        Stage &s = find(stage);
+        s.count++;
+        s.ns += ns;
+        s.maxNs = std::max(s.maxNs, ns);
+        if (trace_ != NULL)
+            *trace_ << name_ << "," << stage << "," << ns;
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            uint64_t delta = stop.values[i] - start.values[i];
+            s.totals[i] += delta;
+            if (trace_ != NULL)
+                *trace_ << "," << delta;
+        }
+        if (trace_ != NULL)
+            *trace_ << "\n";
+    }
+
+    /**
+     * @brief Prints the mean of every counter per stage execution, and the mean/max wall time.
+     */
+    void report(std::ostream &out) const
+    {
+        out << name_ << " stage metrics (mean per execution):" << std::endl;
+        out << std::left << std::setw(16) << "  stage" << std::right << std::setw(10) << "count" << std::setw(12)
+            << "mean us" << std::setw(12) << "max us";
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+            out << std::setw(16) << PERF_COUNTER_NAMES[i];
+        out << std::endl;
+
+        for (const Stage &s : stages_)
+        {
+            double n = double(std::max<uint64_t>(s.count, 1));
+            out << std::left << std::setw(16) << ("  " + std::string(s.name)) << std::right << std::setw(10)
+                << s.count << std::setw(12) << std::fixed << std::setprecision(1) << s.ns / n / 1e3 << std::setw(12)
+                << s.maxNs / 1e3;
+            for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+                out << std::setw(16) << std::setprecision(1) << s.totals[i] / n;
+            out << std::endl;
+        }
+        if (group_ && !group_->available(PERF_CYCLES))
+            out << "  (hardware counters unavailable)" << std::endl;
+        if (group_ && !group_->countsKernel())
+            out << "  (user mode only; kernel mode needs perf_event_paranoid <= 1 or CAP_PERFMON)" << std::endl;
+    }
+
+private:
+    struct Stage
+    {
+        const char *name;
+        uint64_t count = 0;
+        uint64_t ns = 0;
+        uint64_t maxNs = 0;
+        uint64_t totals[NUM_PERF_COUNTERS] = {};
+    };
+
+    Stage &find(const char *stage)
+    {
+        for (Stage &s : stages_)
+        {
+            if (s.name == stage || std::strcmp(s.name, stage) == 0)
+                return s;
+        }
+        stages_.push_back(Stage());
+        stages_.back().name = stage;
+        return stages_.back();
+    }
+
+    std::string name_;
+    std::unique_ptr<PerfCounterGroup> group_;
+    std::vector<Stage> stages_;
+    std::ostream *trace_ = NULL;
+};
+
+/**
+ * @brief Samples the enclosing block as one stage; does nothing if metrics is NULL.
+ */
+class PerfStageScope
+{
+public:
+    PerfStageScope(StageMetrics *metrics, const char *stage) : metrics_(metrics), stage_(stage)
+    {
+        if (metrics_ == NULL)
+            return;
+        start_ = metrics_->begin();
+        startTime_ = std::chrono::steady_clock::now();
+    }
+
+    ~PerfStageScope()
+    {
+        if (metrics_ == NULL)
+            return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime_);
+        metrics_->end(stage_, start_, uint64_t(ns.count()));
+    }
+
+    PerfStageScope(const PerfStageScope &) = delete;
+    PerfStageScope &operator=(const PerfStageScope &) = delete;
+
+private:
+    StageMetrics *metrics_;
+    const char *stage_;
+    PerfCounterGroup::Sample start_;
+    std::chrono::steady_clock::time_point startTime_;
+};
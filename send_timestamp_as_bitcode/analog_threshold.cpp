@@ -0,0 +1,263 @@
+#pragma once
+
+/**
+ * Conversion of a sync line recorded on an analog input (an Intan board ADC, an NI AI channel) into a bit plane for
+ * the batch decoder.
+ *
+ * The LOW and HIGH levels are estimated from a few runs of samples spread over the recording. The samples are then
+ * compared with two thresholds between the levels, with hysteresis: a sample above the upper threshold is HIGH, one
+ * below the lower threshold is LOW, and one in between keeps the state of the sample before it, so noise on a slow
+ * edge does not split a digit. The comparisons are done 16 samples at a time with SSE2, giving an above and a below
+ * mask per 64 samples. The hysteresis of all 64 samples is then resolved with one addition, whose carry runs from
+ * every HIGH sample through the samples in between up to the next LOW one.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bit_planes.cpp"
+
+constexpr size_t ANALOG_LEVEL_RUNS = 256;          // Runs of samples read to estimate the levels
+constexpr size_t ANALOG_LEVEL_RUN_SAMPLES = 4096;  // Samples per run
+constexpr double ANALOG_LEVEL_PERCENTILE = 1e-4;   // Levels are this far in from the extremes, to ignore spikes
+constexpr double ANALOG_LOWER_THRESHOLD = 1.0 / 3; // Fraction of the swing from LOW below which a sample is LOW
+constexpr double ANALOG_UPPER_THRESHOLD = 2.0 / 3; // Fraction of the swing from LOW above which a sample is HIGH
+
+/**
+ * @brief Sample formats of analog recordings.
+ */
+enum class AnalogSampleType
+{
+    Int16,   // e.g. NI AI raw samples
+    UInt16,  // Offset binary, e.g. Intan board ADC files
+    Float32, // e.g. NI AI scaled samples (volts)
+};
+
+/**
+ * @brief LOW and HIGH levels of an analog sync line, in sample units.
+ */
+struct AnalogLevels
+{
+    double low = 0.0;
+    double high = 0.0;
+};
+
+/**
+ * @brief Sets bit i of above if sample i is above high, and of below if it is below low, for up to 64 samples.
+ *
+ * Missing samples of a last, partial word count as below, so they are LOW.
+ */
+inline void compareAnalog64(const int16_t *samples, size_t count, int16_t low, int16_t high, uint64_t &above,
+                            uint64_t &below)
+{
+    above = 0;
+    below = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i lowVector = _mm_set1_epi16(low);
+    const __m128i highVector = _mm_set1_epi16(high);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i first = _mm_loadu_si128((const __m128i *)(samples + i));
+        __m128i second = _mm_loadu_si128((const __m128i *)(samples + i + 8));
+        __m128i isAbove = _mm_packs_epi16(_mm_cmpgt_epi16(first, highVector), _mm_cmpgt_epi16(second, highVector));
+        __m128i isBelow = _mm_packs_epi16(_mm_cmplt_epi16(first, lowVector), _mm_cmplt_epi16(second, lowVector));
+        above |= uint64_t(unsigned(_mm_movemask_epi8(isAbove))) << i;
+        below |= uint64_t(unsigned(_mm_movemask_epi8(isBelow))) << i;
+    }
+#endif
+    for (; i < count; i++)
+    {
+        above |= uint64_t(samples[i] > high) << i;
+        below |= uint64_t(samples[i] < low) << i;
+    }
+    if (count < 64)
+        below |= ~uint64_t(0) << count;
+}
+
+inline void compareAnalog64(const uint16_t *samples, size_t count, uint16_t low, uint16_t high, uint64_t &above,
+                            uint64_t &below)
+{
+    above = 0;
+    below = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // SSE2 only compares signed words; flipping the top bit maps offset binary onto them in order
+    const __m128i flip = _mm_set1_epi16(int16_t(0x8000));
+    const __m128i lowVector = _mm_set1_epi16(int16_t(low ^ 0x8000));
+    const __m128i highVector = _mm_set1_epi16(int16_t(high ^ 0x8000));
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i first = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(samples + i)), flip);
+        __m128i second = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(samples + i + 8)), flip);
+        __m128i isAbove = _mm_packs_epi16(_mm_cmpgt_epi16(first, highVector), _mm_cmpgt_epi16(second, highVector));
+        __m128i isBelow = _mm_packs_epi16(_mm_cmplt_epi16(first, lowVector), _mm_cmplt_epi16(second, lowVector));
+        above |= uint64_t(unsigned(_mm_movemask_epi8(isAbove))) << i;
+        below |= uint64_t(unsigned(_mm_movemask_epi8(isBelow))) << i;
+    }
+#endif
+    for (; i < count; i++)
+    {
+        above |= uint64_t(samples[i] > high) << i;
+        below |= uint64_t(samples[i] < low) << i;
+    }
+    if (count < 64)
+        below |= ~uint64_t(0) << count;
+}
+
+inline void compareAnalog64(const float *samples, size_t count, float low, float high, uint64_t &above, uint64_t &below)
+{
+    above = 0;
+    below = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // NaN compares false both ways, so it keeps the state
+    const __m128 lowVector = _mm_set1_ps(low);
+    const __m128 highVector = _mm_set1_ps(high);
+    for (; i + 16 <= count; i += 16)
+    {
+        for (size_t j = 0; j < 16; j += 4)
+        {
+            __m128 x = _mm_loadu_ps(samples + i + j);
+            above |= uint64_t(unsigned(_mm_movemask_ps(_mm_cmpgt_ps(x, highVector)))) << (i + j);
+            below |= uint64_t(unsigned(_mm_movemask_ps(_mm_cmplt_ps(x, lowVector)))) << (i + j);
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        above |= uint64_t(samples[i] > high) << i;
+        below |= uint64_t(samples[i] < low) << i;
+    }
+    if (count < 64)
+        below |= ~uint64_t(0) << count;
+}
+
+/**
+ * @brief Converts a threshold to the sample type, rounding away from the middle of the band for integers.
+ */
+template <typename T>
+inline T analogThreshold(double threshold, bool upper)
+{
+    if (!std::is_integral<T>::value)
+        return T(threshold);
+    double rounded = upper ? std::ceil(threshold) : std::floor(threshold);
+    rounded = std::max(rounded, double(std::numeric_limits<T>::min()));
+    return T(std::min(rounded, double(std::numeric_limits<T>::max())));
+}
+
+/**
+ * @brief Estimates the LOW and HIGH levels from ANALOG_LEVEL_RUNS runs of samples spread evenly over the recording.
+ *
+ * Reading runs rather than single samples keeps the estimate to a few pages of a mapped recording of several hours.
+ * The HIGH level is only found if some runs overlap bitcodes; a line that is HIGH for less than about ten times
+ * ANALOG_LEVEL_PERCENTILE of the runs needs its levels given explicitly.
+ *
+ * @return false if there are no samples or the levels are equal (a flat channel)
+ */
+template <typename T>
+inline bool estimateAnalogLevels(const T *samples, size_t numSamples, AnalogLevels &levels)
+{
+    std::vector<T> subset;
+    size_t runSamples = std::min(ANALOG_LEVEL_RUN_SAMPLES, numSamples);
+    size_t runs = runSamples == 0 ? 0 : std::min(ANALOG_LEVEL_RUNS, numSamples / runSamples);
+    subset.reserve(runs * runSamples);
+    for (size_t run = 0; run < runs; run++)
+    {
+        const T *start = samples + (numSamples - runSamples) / std::max<size_t>(runs - 1, 1) * run;
+        for (size_t i = 0; i < runSamples; i++)
+        {
+            if (start[i] == start[i]) // Not NaN
+                subset.push_back(start[i]);
+        }
+    }
+    if (subset.empty())
+        return false;
+
+    size_t lowRank = size_t(double(subset.size() - 1) * ANALOG_LEVEL_PERCENTILE);
+    size_t highRank = subset.size() - 1 - lowRank;
+    std::nth_element(subset.begin(), subset.begin() + lowRank, subset.end());
+    levels.low = double(subset[lowRank]);
+    std::nth_element(subset.begin() + lowRank, subset.begin() + highRank, subset.end());
+    levels.high = double(subset[highRank]);
+    return levels.high > levels.low;
+}
+
+/**
+ * @brief Converts analog samples to a bit plane with the hysteresis thresholds of the given levels.
+ *
+ * Samples are LOW until the first one outside the band between the thresholds.
+ */
+template <typename T>
+inline BitPlane thresholdToBitPlane(const T *samples, size_t numSamples, const AnalogLevels &levels)
+{
+    const double swing = levels.high - levels.low;
+    const T low = analogThreshold<T>(levels.low + swing * ANALOG_LOWER_THRESHOLD, false);
+    const T high = analogThreshold<T>(levels.low + swing * ANALOG_UPPER_THRESHOLD, true);
+
+    BitPlane plane;
+    plane.numSamples = numSamples;
+    plane.words.resize((numSamples + 63) / 64);
+    uint64_t state = 0; // Last sample of the previous word
+    for (size_t word = 0; word < plane.words.size(); word++)
+    {
+        uint64_t above;
+        uint64_t below;
+        compareAnalog64(samples + 64 * word, std::min<size_t>(64, numSamples - 64 * word), low, high, above, below);
+        // Adding above to notBelow carries out of every HIGH sample (and in from a HIGH state) through the samples in
+        // the band, clearing them, until the next LOW sample; the sum stays set in the band after a LOW sample
+        uint64_t notBelow = ~below;
+        uint64_t sum = notBelow + above + state;
+        plane.words[word] = (~sum & notBelow) | above;
+        state = plane.words[word] >> 63;
+    }
+    return plane;
+}
+
+/**
+ * @brief Converts analog samples to a bit plane, estimating their levels first unless they are given.
+ *
+ * @param levels levels to use; estimated and set if high is not above low
+ * @return false if the levels cannot be estimated (see estimateAnalogLevels)
+ */
+template <typename T>
+inline bool analogToBitPlane(const T *samples, size_t numSamples, AnalogLevels &levels, BitPlane &plane)
+{
+    if (levels.high <= levels.low && !estimateAnalogLevels(samples, numSamples, levels))
+        return false;
+    plane = thresholdToBitPlane(samples, numSamples, levels);
+    return true;
+}
+
+/**
+ * @brief Converts a raw analog recording of one channel to a bit plane (see the typed analogToBitPlane).
+ *
+ * @param data samples of the given type
+ * @param bytes size of data; a trailing partial sample is ignored
+ * @param levels levels to use; estimated and set if high is not above low
+ * @param plane set to the line
+ * @return false if the levels cannot be estimated (see estimateAnalogLevels)
+ */
+inline bool analogToBitPlane(const uint8_t *data, size_t bytes, AnalogSampleType type, AnalogLevels &levels,
+                             BitPlane &plane)
+{
+    switch (type)
+    {
+    case AnalogSampleType::Int16:
+        return analogToBitPlane(reinterpret_cast<const int16_t *>(data), bytes / sizeof(int16_t), levels, plane);
+    case AnalogSampleType::UInt16:
+        return analogToBitPlane(reinterpret_cast<const uint16_t *>(data), bytes / sizeof(uint16_t), levels, plane);
+    case AnalogSampleType::Float32:
+        return analogToBitPlane(reinterpret_cast<const float *>(data), bytes / sizeof(float), levels, plane);
+    }
+    return false;
+}
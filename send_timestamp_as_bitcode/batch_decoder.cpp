@@ -0,0 +1,450 @@
+#pragma once
+
+/**
+ * Offline decoding of many bitcode frames from one capture of the sync line, stored either as one byte per sample
+ * (non-zero is HIGH) or as a BitPlane of a multi-line port capture.
+ *
+ * Each frame is gathered with one sample per digit, at the middle of the digit period, which tolerates edge jitter of
+ * up to half a digit. Marker checks, the Hamming correction and out-of-range frames are handled with masks,
+ * selects and lookup tables instead of branches. Since every cache line of a frame is touched anyway, a single thread
+ * is bound by memory bandwidth on large captures; large batches are therefore split over threads, each writing its own
+ * range of the struct-of-arrays result.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "bit_planes.cpp"
+#include "bitcode_format.cpp"
+
+constexpr size_t DECODE_FRAMES_PER_THREAD = 4096; // Minimum frames per thread; smaller batches use fewer threads
+constexpr size_t ABORT_SEARCH_DIGITS = 20;        // Digits after a frame's end searched for its abort marker
+
+/**
+ * @brief Error flags of a decoded frame; a frame without flags decoded cleanly.
+ */
+enum FrameFlags : uint8_t
+{
+    FRAME_BAD_MARKERS = 1 << 0,   // Start digits were not "01" or end digits were not "10"
+    FRAME_CORRECTED = 1 << 1,     // A single flipped digit was corrected (fec only)
+    FRAME_UNCORRECTABLE = 1 << 2, // Two or more flipped digits were detected; data is unreliable (fec only)
+    FRAME_OUT_OF_RANGE = 1 << 3,  // Frame extends past the end of the capture; data is 0
+    FRAME_UNRESOLVED = 1 << 4     // Short frame without a preceding full frame; data holds only the low bits
+};
+
+/**
+ * @brief Decoded frames as a struct of arrays; index i belongs to frameStarts[i].
+ */
+struct DecodedFrames
+{
+    std::vector<uint64_t> timestamps;
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> tags; // Source tag; 0 for formats without tag digits
+
+    size_t size() const { return timestamps.size(); }
+};
+
+/**
+ * @brief State of a frame search over a capture that is decoded one chunk at a time.
+ *
+ * The caller keeps the samples from one digit before next onwards and appends the next chunk to them; shift() moves
+ * the state along when samples are dropped from the front. Until the last chunk, a frame is only taken once all
+ * samples it (and the search for its abort marker) needs are there, so no frame is split across chunks.
+ */
+struct FrameSearch
+{
+    size_t next = 0;              // Sample from which the next frame start is searched
+    bool last = true;             // Whether the samples reach the end of the capture
+    bool haveReference = false;   // Adaptive decoding: whether a clean full frame was seen, and its timestamp and start
+    uint64_t referenceTimestamp = 0;
+    uint64_t referenceSample = 0; // May wrap below 0 after shifts; only differences to it are used
+
+    void shift(size_t samples)
+    {
+        next -= samples;
+        referenceSample -= samples;
+    }
+};
+
+/**
+ * @brief Samples after the start marker's rising edge that the search needs to take a frame.
+ */
+inline size_t frameReach(size_t frameLength, size_t digitLength, bool preempt)
+{
+    // The abort marker starts before the first rising edge at most ABORT_SEARCH_DIGITS after the frame, and takes less
+    // than three digits
+    return frameLength + (preempt ? (ABORT_SEARCH_DIGITS + 3) * digitLength : 0);
+}
+
+/**
+ * @brief Finds the first LOW to HIGH transition at or after a sample.
+ *
+ * @return size_t index of the first HIGH sample of the transition, or numSamples if there is none
+ */
+inline size_t nextRisingEdge(const uint8_t *samples, size_t numSamples, size_t from)
+{
+    for (size_t i = from; i < numSamples; i++)
+    {
+        if (samples[i] != 0 && samples[i - 1] == 0)
+            return i;
+    }
+    return numSamples;
+}
+
+inline size_t nextRisingEdge(const BitPlane &samples, size_t numSamples, size_t from)
+{
+    return std::min(samples.nextRisingEdge(from), numSamples);
+}
+
+/**
+ * @brief Finds the first HIGH to LOW transition at or after a sample.
+ *
+ * @return size_t index of the first LOW sample of the transition, or numSamples if there is none
+ */
+inline size_t nextFallingEdge(const uint8_t *samples, size_t numSamples, size_t from)
+{
+    for (size_t i = from; i < numSamples; i++)
+    {
+        if (samples[i] == 0 && samples[i - 1] != 0)
+            return i;
+    }
+    return numSamples;
+}
+
+inline size_t nextFallingEdge(const BitPlane &samples, size_t numSamples, size_t from)
+{
+    return std::min(samples.nextFallingEdge(from), numSamples);
+}
+
+/**
+ * @brief Finds an abort marker (see writeAbortMarker) that starts in a range of samples.
+ *
+ * The marker is recognized by its two HIGH pulses and the gap between them, all about half a digit long; runs of a
+ * frame last whole digits, and the run cut short by the abort is followed by at least one LOW digit.
+ *
+ * @return size_t index of the falling edge ending the marker's second pulse, or numSamples if there is none
+ */
+template <typename Samples>
+size_t findAbortMarker(const Samples &samples, size_t numSamples, size_t from, size_t to, int digitRepeats)
+{
+    const size_t pulse = size_t(digitRepeats / 2);
+    const size_t tolerance = size_t(digitRepeats / 4);
+    auto isPulse = [&](size_t length) { return length + tolerance >= pulse && length <= pulse + tolerance; };
+
+    for (size_t rise = nextRisingEdge(samples, numSamples, from); rise < std::min(to, numSamples);
+         rise = nextRisingEdge(samples, numSamples, rise + 1))
+    {
+        size_t fall = nextFallingEdge(samples, numSamples, rise + 1);
+        if (!isPulse(fall - rise))
+            continue;
+        size_t rise2 = nextRisingEdge(samples, numSamples, fall + 1);
+        size_t fall2 = nextFallingEdge(samples, numSamples, rise2 + 1);
+        if (fall2 < numSamples && isPulse(rise2 - fall) && isPulse(fall2 - rise2))
+            return fall2;
+    }
+    return numSamples;
+}
+
+/**
+ * @brief Searches a frame for an abort marker, up to the first rising edge after its nominal end (at most
+ * ABORT_SEARCH_DIGITS later), which is either the marker or the next frame.
+ *
+ * @param rise rising edge of the frame's start marker
+ * @param frameLength nominal length of the frame
+ * @return size_t as findAbortMarker
+ */
+template <typename Samples>
+size_t findFrameAbort(const Samples &samples, size_t numSamples, size_t rise, size_t frameLength, int digitRepeats)
+{
+    const size_t digitLength = size_t(digitRepeats);
+    size_t frameEnd = rise - digitLength + frameLength;
+    size_t searchEnd =
+        std::min(frameEnd + ABORT_SEARCH_DIGITS * digitLength, nextRisingEdge(samples, numSamples, frameEnd) + 1);
+    return findAbortMarker(samples, numSamples, rise, searchEnd, digitRepeats);
+}
+
+/**
+ * @brief Finds the start of every frame in a capture.
+ *
+ * A frame starts one digit before the rising edge of its "01" start marker. After a frame is found, the search resumes
+ * after its end, so edges inside the timestamp are not mistaken for frame starts.
+ *
+ * If the sender may preempt bitcodes, pass aborted: each frame is then also searched for an abort marker, up to the
+ * first rising edge after its nominal end (at most ABORT_SEARCH_DIGITS later). A frame with a marker is reported in
+ * aborted instead, and the search resumes right after the marker, where the preempting frame starts.
+ *
+ * @tparam Samples const uint8_t * (one byte per sample) or BitPlane
+ * @param samples capture of the sync line
+ * @param numSamples number of samples
+ * @param format frame layout
+ * @param aborted if not NULL, receives the first sample of each aborted frame
+ * @param search if not NULL, the search continues from search->next and stops before a frame that may reach past the
+ * samples unless search->last; search->next is then set to where it stopped
+ * @return std::vector<uint64_t> sample index of the first sample of each complete frame
+ */
+template <typename Samples>
+std::vector<uint64_t> findFrameStarts(const Samples &samples, size_t numSamples,
+                                      const FrameFormat &format = FrameFormat::timestamp(),
+                                      std::vector<uint64_t> *aborted = NULL, FrameSearch *search = NULL)
+{
+    const size_t frameLength = format.length();
+    const size_t digitLength = format.digitRepeats;
+    const size_t reach = frameReach(frameLength, digitLength, aborted != NULL);
+    std::vector<uint64_t> frameStarts;
+    size_t i = nextRisingEdge(samples, numSamples, std::max(digitLength, search != NULL ? search->next : 0));
+    while (i < numSamples)
+    {
+        if (search != NULL && !search->last && i + reach > numSamples)
+            break;
+        if (aborted != NULL)
+        {
+            size_t marker = findFrameAbort(samples, numSamples, i, frameLength, format.digitRepeats);
+            if (marker < numSamples)
+            {
+                aborted->push_back(i - digitLength);
+                i = nextRisingEdge(samples, numSamples, marker + 1);
+                continue;
+            }
+        }
+        frameStarts.push_back(i - digitLength);
+        i = nextRisingEdge(samples, numSamples, i + frameLength - digitLength);
+    }
+    if (search != NULL)
+        search->next = i;
+    return frameStarts;
+}
+
+/**
+ * @brief Decodes the frames frameStarts[first..last) into results, which must already have room for them.
+ */
+template <typename Samples>
+void decodeFrameRange(const Samples &samples, size_t numSamples, const uint64_t *frameStarts, size_t first,
+                      size_t last, const FrameFormat &format, DecodedFrames &results)
+{
+    const int numDigits = format.numDigits();
+    const int repeats = format.digitRepeats;
+    const size_t frameLength = format.length();
+    if (numSamples < frameLength)
+    {
+        std::fill(results.timestamps.begin() + first, results.timestamps.begin() + last, 0);
+        std::fill(results.flags.begin() + first, results.flags.begin() + last, uint8_t(FRAME_OUT_OF_RANGE));
+        std::fill(results.tags.begin() + first, results.tags.begin() + last, 0);
+        return;
+    }
+    const uint8_t checkMask = format.fec ? 0xFF : 0; // No check digits without fec
+    uint64_t *timestamps = results.timestamps.data();
+    uint8_t *frameFlags = results.flags.data();
+    uint8_t *frameTags = results.tags.data();
+
+    for (size_t i = first; i < last; i++)
+    {
+        // Frames past the end of the capture read the first frame's worth of samples instead, and are flagged
+        uint64_t start = frameStarts[i];
+        bool outOfRange = start > numSamples - frameLength;
+        size_t digit0 = size_t(outOfRange ? 0 : start) + repeats / 2;
+
+        // Start marker, tag, data, then the check digits and end marker in the low bits of trailer
+        uint64_t head = (uint64_t(samples[digit0] != 0) << 1) | (samples[digit0 + repeats] != 0);
+        const int tagDigit0 = 2 + format.lengthFlag;
+        int k = tagDigit0;
+        uint8_t tag = 0;
+        for (; k < tagDigit0 + format.tagBits; k++)
+            tag = uint8_t((tag << 1) | (samples[digit0 + k * repeats] != 0));
+        uint64_t n = 0;
+        for (; k < tagDigit0 + format.tagBits + format.dataBits; k++)
+            n = (n << 1) | (samples[digit0 + k * repeats] != 0);
+        uint64_t trailer = 0;
+        for (; k < numDigits; k++)
+            trailer = (trailer << 1) | (samples[digit0 + k * repeats] != 0);
+
+        int corrected = 0;
+        if (format.fec)
+            corrected = correctFrame(format, n, tag, uint8_t(trailer >> 2) & checkMask);
+
+        uint8_t flags = uint8_t((head != 1 || (trailer & 3) != 2) * FRAME_BAD_MARKERS);
+        flags |= uint8_t((corrected == 1) * FRAME_CORRECTED);
+        flags |= uint8_t((corrected < 0) * FRAME_UNCORRECTABLE);
+        timestamps[i] = outOfRange ? 0 : n;
+        frameFlags[i] = outOfRange ? uint8_t(FRAME_OUT_OF_RANGE) : flags;
+        frameTags[i] = outOfRange ? 0 : tag;
+    }
+}
+
+/**
+ * @brief Decodes a batch of frames from a capture.
+ *
+ * @tparam Samples const uint8_t * (one byte per sample) or BitPlane
+ * @param samples capture of the sync line
+ * @param numSamples number of samples
+ * @param frameStarts sample index of the first sample of each frame, e.g. from findFrameStarts
+ * @param numFrames number of frames
+ * @param format frame layout
+ * @param numThreads number of threads; 0 to use all hardware threads
+ * @return DecodedFrames
+ */
+template <typename Samples>
+DecodedFrames decodeFrames(const Samples &samples, size_t numSamples, const uint64_t *frameStarts, size_t numFrames,
+                           const FrameFormat &format = FrameFormat::timestamp(), unsigned numThreads = 0)
+{
+    DecodedFrames results;
+    results.timestamps.resize(numFrames);
+    results.flags.resize(numFrames);
+    results.tags.resize(numFrames);
+
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t maxThreads = std::max<size_t>(1, numFrames / DECODE_FRAMES_PER_THREAD);
+    numThreads = unsigned(std::min<size_t>(numThreads, maxThreads));
+
+    // Split into contiguous ranges; each thread writes only its own range of the results
+    size_t framesPerThread = (numFrames + numThreads - 1) / numThreads;
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < numThreads; t++)
+    {
+        size_t first = std::min(numFrames, t * framesPerThread);
+        size_t last = std::min(numFrames, (t + 1) * framesPerThread);
+        threads.emplace_back(decodeFrameRange<Samples>, std::cref(samples), numSamples, frameStarts, first, last,
+                             std::cref(format), std::ref(results));
+    }
+    decodeFrameRange(samples, numSamples, frameStarts, 0, std::min(numFrames, framesPerThread), format, results);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return results;
+}
+
+/**
+ * @brief Splits tagged frames by source.
+ *
+ * Frames with a flag other than FRAME_CORRECTED are left out, since their tag cannot be trusted.
+ *
+ * @param frames frames decoded with a tagged format
+ * @return std::vector<std::vector<size_t>> for each of the NUM_SOURCES tags, the indices of its frames in order
+ */
+std::vector<std::vector<size_t>> demultiplexByTag(const DecodedFrames &frames)
+{
+    std::vector<std::vector<size_t>> sources(NUM_SOURCES);
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if ((frames.flags[i] & ~FRAME_CORRECTED) == 0)
+            sources[frames.tags[i] & (NUM_SOURCES - 1)].push_back(i);
+    }
+    return sources;
+}
+
+/**
+ * @brief Decodes a capture of a sender that switches between full and short codes (see FrameFormat::adaptive).
+ *
+ * Frames are found with the length given by their length flag and decoded in one batch per length. Short frames
+ * carry only the low SHORT_TIMESTAMP_BITS bits of the timestamp; the high bits are restored from the most recent clean
+ * full frame, advanced by the samples in between, so short frames stay correct across wraps of their low bits. This
+ * assumes timestamps in microseconds, like getCPUClockTimeUS.
+ *
+ * If the sender may preempt bitcodes, pass aborted, as for findFrameStarts; each frame is searched for an abort marker
+ * after the length given by its flag. A frame cut short before its flag is read as a full one, whose search range
+ * still covers the marker.
+ *
+ * @tparam Samples const uint8_t * (one byte per sample) or BitPlane
+ * @param samples capture of the sync line
+ * @param numSamples number of samples
+ * @param fec whether the frames carry Hamming check digits
+ * @param tagged whether the frames carry a source tag
+ * @param sampleRate sample rate of the capture (Hz); a digit lasts sampleRate / DIGIT_SAMPLE_HZ samples
+ * @param frameStarts set to the first sample of each complete frame
+ * @param aborted if not NULL, receives the first sample of each aborted frame
+ * @param search if not NULL, continues the search as for findFrameStarts, and carries the last clean full frame over
+ * to the next chunk
+ * @return DecodedFrames full timestamps, in the order of frameStarts
+ */
+template <typename Samples>
+DecodedFrames decodeAdaptiveFrames(const Samples &samples, size_t numSamples, bool fec, bool tagged, double sampleRate,
+                                   std::vector<uint64_t> &frameStarts, std::vector<uint64_t> *aborted = NULL,
+                                   FrameSearch *search = NULL)
+{
+    FrameFormat formats[2] = {FrameFormat::adaptive(false, fec, tagged), FrameFormat::adaptive(true, fec, tagged)};
+    const size_t digitLength = size_t(std::lround(sampleRate / DIGIT_SAMPLE_HZ));
+    formats[0].digitRepeats = formats[1].digitRepeats = int(digitLength);
+    const size_t reach = frameReach(formats[0].length(), digitLength, aborted != NULL); // Full frames are longer
+
+    // Find frames, reading the length flag at the middle of the third digit
+    std::vector<uint64_t> starts[2];
+    std::vector<uint8_t> isShort;
+    frameStarts.clear();
+    size_t i = nextRisingEdge(samples, numSamples, std::max(digitLength, search != NULL ? search->next : 0));
+    while (i < numSamples)
+    {
+        if (search != NULL && !search->last && i + reach > numSamples)
+            break;
+        size_t flagSample = i + digitLength + digitLength / 2;
+        int length = flagSample < numSamples && samples[flagSample] != 0;
+        if (aborted != NULL)
+        {
+            size_t marker = findFrameAbort(samples, numSamples, i, formats[length].length(), int(digitLength));
+            if (marker < numSamples)
+            {
+                aborted->push_back(i - digitLength);
+                i = nextRisingEdge(samples, numSamples, marker + 1);
+                continue;
+            }
+        }
+        frameStarts.push_back(i - digitLength);
+        starts[length].push_back(i - digitLength);
+        isShort.push_back(uint8_t(length));
+        i = nextRisingEdge(samples, numSamples, i + formats[length].length() - digitLength);
+    }
+    if (search != NULL)
+        search->next = i;
+    DecodedFrames decoded[2];
+    for (int length = 0; length < 2; length++)
+        decoded[length] =
+            decodeFrames(samples, numSamples, starts[length].data(), starts[length].size(), formats[length]);
+
+    // Merge in order, restoring the high bits of short frames
+    DecodedFrames results;
+    size_t next[2] = {0, 0};
+    bool haveReference = search != NULL && search->haveReference;
+    uint64_t referenceTimestamp = search != NULL ? search->referenceTimestamp : 0;
+    uint64_t referenceSample = search != NULL ? search->referenceSample : 0;
+    for (size_t f = 0; f < frameStarts.size(); f++)
+    {
+        int length = isShort[f];
+        size_t j = next[length]++;
+        uint64_t timestamp = decoded[length].timestamps[j];
+        uint8_t flags = decoded[length].flags[j];
+        bool clean = (flags & ~FRAME_CORRECTED) == 0;
+        if (length == 0 && clean)
+        {
+            haveReference = true;
+            referenceTimestamp = timestamp;
+            referenceSample = frameStarts[f];
+        }
+        else if (length == 1 && !haveReference)
+        {
+            flags |= FRAME_UNRESOLVED;
+        }
+        else if (length == 1)
+        {
+            // Predict the full timestamp, then move it to the nearest value with the received low bits
+            double elapsedUS = double(frameStarts[f] - referenceSample) * 1e6 / sampleRate;
+            uint64_t predicted = referenceTimestamp + uint64_t(std::llround(elapsedUS));
+            const uint64_t wrap = uint64_t(1) << SHORT_TIMESTAMP_BITS;
+            uint64_t delta = (timestamp - predicted) & (wrap - 1);
+            timestamp = delta < wrap / 2 ? predicted + delta : predicted + delta - wrap;
+        }
+        results.timestamps.push_back(timestamp);
+        results.flags.push_back(flags);
+        results.tags.push_back(decoded[length].tags[j]);
+    }
+    if (search != NULL)
+    {
+        search->haveReference = haveReference;
+        search->referenceTimestamp = referenceTimestamp;
+        search->referenceSample = referenceSample;
+    }
+    return results;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "bitcode_format.cpp"
+#include "loopback_compare.cpp"
+
+constexpr int BER_WINDOW_FRAMES = 256; // Frames averaged by the rolling error rates (exponential window)
+
+/**
+ * @brief Online bit error statistics of one sync line, from the loopback of every bitcode sent.
+ *
+ * The monitor takes the wrong samples found by the loopback comparison of the sender (compareLoopback), so the
+ * samples are compared only once per bitcode and a bitcode without errors costs a few counter updates. A digit error is
+ * a wrong sample at the middle of a digit, where the offline decoder reads it. The margin of a digit is the distance
+ * from its middle to the nearest wrong sample (DIGIT_REPEATS / 2 + 1 if there is none), so it shrinks long before
+ * digits fail: slow edges or skew show up as errors at the start of digits, noise as errors anywhere in them (see the
+ * histogram by offset in the digit). The smallest margin seen also bounds how far DIGIT_REPEATS could be lowered on
+ * this wiring.
+ *
+ * Counters are written by the sender thread only; the rolling rates may be read from any thread.
+ */
+class BitErrorMonitor
+{
+public:
+    /**
+     * @brief Records the wrong samples of one bitcode read back.
+     *
+     * @param wrongSamples mask of the wrong samples, as set by compareLoopback
+     * @param mismatch result of the same compareLoopback
+     * @param length number of samples written; DIGIT_REPEATS per digit
+     */
+    void record(const uint64_t *wrongSamples, const LoopbackMismatch &mismatch, int length)
+    {
+        const int mid = DIGIT_REPEATS / 2;
+        int numDigits = length / DIGIT_REPEATS;
+        uint64_t frameSampleErrors = 0;
+        uint64_t frameDigitErrors = 0;
+
+        // Only the wrong samples are visited, in order, so the margin of a digit is final once the next one starts
+        int digit = -1;
+        int margin = mid + 1;
+        for (int word = 0; mismatch.count != 0 && word < (numDigits * DIGIT_REPEATS + 63) / 64; word++)
+        {
+            for (uint64_t bits = wrongSamples[word]; bits != 0; bits &= bits - 1)
+            {
+                int i = 64 * word + __builtin_ctzll(bits);
+                if (i >= numDigits * DIGIT_REPEATS)
+                    break;
+                int k = i / DIGIT_REPEATS;
+                int j = i % DIGIT_REPEATS;
+                if (k != digit)
+                {
+                    frameDigitErrors += uint64_t(margin == 0);
+                    minMarginSamples_ = margin < minMarginSamples_ ? margin : minMarginSamples_;
+                    digit = k;
+                    margin = mid + 1;
+                }
+                int distance = j < mid ? mid - j : j - mid;
+                margin = distance < margin ? distance : margin;
+                offsetErrors_[j]++;
+                positionErrors_[k < MAX_NUM_DIGITS ? k : MAX_NUM_DIGITS - 1]++;
+                frameSampleErrors++;
+            }
+        }
+        frameDigitErrors += uint64_t(margin == 0);
+        minMarginSamples_ = margin < minMarginSamples_ ? margin : minMarginSamples_;
+
+        frames_++;
+        samples_ += uint64_t(numDigits) * DIGIT_REPEATS;
+        sampleErrors_ += frameSampleErrors;
+        digits_ += uint64_t(numDigits);
+        digitErrors_ += frameDigitErrors;
+
+        // Exponentially weighted over about BER_WINDOW_FRAMES frames; the first frames are averaged evenly
+        double weight = 1.0 / double(frames_ < BER_WINDOW_FRAMES ? frames_ : BER_WINDOW_FRAMES);
+        double sampleRate = double(frameSampleErrors) / double(numDigits * DIGIT_REPEATS);
+        double digitRate = double(frameDigitErrors) / double(numDigits);
+        double rollingSample = rollingSampleErrorRate_.load(std::memory_order_relaxed);
+        double rollingDigit = rollingDigitErrorRate_.load(std::memory_order_relaxed);
+        rollingSampleErrorRate_.store(rollingSample + weight * (sampleRate - rollingSample), std::memory_order_relaxed);
+        rollingDigitErrorRate_.store(rollingDigit + weight * (digitRate - rollingDigit), std::memory_order_relaxed);
+    }
+
+    uint64_t frames() const { return frames_; }
+    uint64_t sampleErrors() const { return sampleErrors_; }
+    uint64_t digitErrors() const { return digitErrors_; }
+    int minMarginSamples() const { return minMarginSamples_; }
+    double rollingSampleErrorRate() const { return rollingSampleErrorRate_.load(std::memory_order_relaxed); }
+    double rollingDigitErrorRate() const { return rollingDigitErrorRate_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Prints the error rates, the smallest margin and the nonzero bins of both histograms.
+     */
+    void report(std::ostream &out, const std::string &name) const
+    {
+        double samples = double(samples_ > 0 ? samples_ : 1);
+        double digits = double(digits_ > 0 ? digits_ : 1);
+        out << name << " bit errors over " << frames_ << " frames:" << std::endl;
+        out << "  samples: " << sampleErrors_ << " wrong (" << sampleErrors_ / samples << ", rolling "
+            << rollingSampleErrorRate() << ")" << std::endl;
+        out << "  digits: " << digitErrors_ << " wrong (" << digitErrors_ / digits << ", rolling "
+            << rollingDigitErrorRate() << ")" << std::endl;
+
+        // Wrong samples reach at most this far into a digit from its edges, so a digit of 2 * intrusion + 1 samples
+        // would still be read correctly at its middle
+        int intrusion = DIGIT_REPEATS / 2 + 1 - minMarginSamples_;
+        out << "  smallest margin: " << minMarginSamples_ << " of " << DIGIT_REPEATS / 2 + 1 << " samples";
+        if (minMarginSamples_ > 0)
+            out << " (digits of " << 2 * intrusion + 1 << " samples would still be read correctly)";
+        out << std::endl;
+
+        out << "  wrong samples by digit:";
+        for (int k = 0; k < MAX_NUM_DIGITS; k++)
+        {
+            if (positionErrors_[k] != 0)
+                out << " " << k << ":" << positionErrors_[k];
+        }
+        out << std::endl << "  wrong samples by offset in digit:";
+        for (int j = 0; j < DIGIT_REPEATS; j++)
+        {
+            if (offsetErrors_[j] != 0)
+                out << " " << j << ":" << offsetErrors_[j];
+        }
+        out << std::endl;
+    }
+
+private:
+    uint64_t frames_ = 0;
+    uint64_t samples_ = 0;
+    uint64_t sampleErrors_ = 0;
+    uint64_t digits_ = 0;
+    uint64_t digitErrors_ = 0;
+    int minMarginSamples_ = DIGIT_REPEATS / 2 + 1;
+    uint64_t positionErrors_[MAX_NUM_DIGITS] = {}; // Wrong samples by digit position in the frame
+    uint64_t offsetErrors_[DIGIT_REPEATS] = {};    // Wrong samples by offset within the digit
+    std::atomic<double> rollingSampleErrorRate_{0.0};
+    std::atomic<double> rollingDigitErrorRate_{0.0};
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+/**
+ * Splitting of packed port samples (several sync lines captured together, one bit per line) into per-line bit planes.
+ *
+ * The transpose reads the capture once for all lines: 16 samples at a time, the byte holding 8 lines is gathered into
+ * an SSE2 register, and each line's 16 bits are extracted with a shift and a movemask. Line decoders then work on the
+ * planes, which are 8 to 32 times smaller than the capture, so decode cost stays flat as lines are added.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief One line of a capture, packed as one bit per sample (bit i % 64 of word i / 64 is sample i).
+ */
+struct BitPlane
+{
+    std::vector<uint64_t> words;
+    size_t numSamples = 0;
+
+    uint8_t operator[](size_t i) const { return uint8_t((words[i >> 6] >> (i & 63)) & 1); }
+
+    /**
+     * @brief Finds the first LOW to HIGH transition at or after a sample, 64 samples per step.
+     *
+     * @param from first sample that may be HIGH after a LOW sample; at least 1
+     * @return size_t index of the first HIGH sample of the transition, or numSamples if there is none
+     */
+    size_t nextRisingEdge(size_t from) const
+    {
+        for (size_t word = from >> 6; word < words.size(); word++)
+        {
+            // Bit i is set if sample i is HIGH and sample i - 1 is LOW
+            uint64_t previous = (words[word] << 1) | (word > 0 ? words[word - 1] >> 63 : 1);
+            uint64_t edges = words[word] & ~previous;
+            if (word == from >> 6)
+                edges &= ~uint64_t(0) << (from & 63);
+            if (edges != 0)
+            {
+                size_t i = (word << 6) + size_t(__builtin_ctzll(edges));
+                return i < numSamples ? i : numSamples;
+            }
+        }
+        return numSamples;
+    }
+
+    /**
+     * @brief Finds the first HIGH to LOW transition at or after a sample, 64 samples per step.
+     *
+     * @param from first sample that may be LOW after a HIGH sample; at least 1
+     * @return size_t index of the first LOW sample of the transition, or numSamples if there is none
+     */
+    size_t nextFallingEdge(size_t from) const
+    {
+        for (size_t word = from >> 6; word < words.size(); word++)
+        {
+            // Bit i is set if sample i is LOW and sample i - 1 is HIGH
+            uint64_t previous = (words[word] << 1) | (word > 0 ? words[word - 1] >> 63 : 0);
+            uint64_t edges = ~words[word] & previous;
+            if (word == from >> 6)
+                edges &= ~uint64_t(0) << (from & 63);
+            if (edges != 0)
+            {
+                size_t i = (word << 6) + size_t(__builtin_ctzll(edges));
+                return i < numSamples ? i : numSamples;
+            }
+        }
+        return numSamples;
+    }
+};
+
+/**
+ * @brief Transposes packed port samples into one bit plane per line.
+ *
+ * @param samples capture; numSamples samples of bytesPerSample bytes each, little-endian (e.g. uInt8/uInt32 port reads,
+ * or the 16-bit words of Intan digital inputs)
+ * @param numSamples number of samples
+ * @param bytesPerSample 1, 2 or 4
+ * @param numLines number of lines to extract, starting at line 0 (bit 0 of the sample)
+ * @param lineMask lines to extract; the planes of the other lines are left empty, and bytes without any of the lines
+ * are not read
+ * @return std::vector<BitPlane> one plane per line
+ */
+std::vector<BitPlane> transposeToBitPlanes(const uint8_t *samples, size_t numSamples, int bytesPerSample, int numLines,
+                                           uint32_t lineMask = 0xFFFFFFFF)
+{
+    std::vector<BitPlane> planes(numLines);
+    for (int line = 0; line < numLines; line++)
+    {
+        if ((lineMask >> line) & 1)
+        {
+            planes[line].words.assign((numSamples + 63) / 64, 0);
+            planes[line].numSamples = numSamples;
+        }
+    }
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= numSamples; i += 16)
+    {
+        const uint8_t *block = samples + i * bytesPerSample;
+        for (int byte = 0; byte * 8 < numLines; byte++)
+        {
+            if (((lineMask >> (8 * byte)) & 0xFF) == 0)
+                continue;
+
+            // Gather this byte of 16 consecutive samples into one register
+            __m128i packed;
+            if (bytesPerSample == 1)
+            {
+                packed = _mm_loadu_si128((const __m128i *)block);
+            }
+            else if (bytesPerSample == 2)
+            {
+                __m128i mask = _mm_set1_epi16(0xFF);
+                __m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)block), 8 * byte), mask);
+                __m128i hi =
+                    _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)(block + 16)), 8 * byte), mask);
+                packed = _mm_packus_epi16(lo, hi);
+            }
+            else
+            {
+                __m128i mask = _mm_set1_epi32(0xFF);
+                __m128i v[4];
+                for (int j = 0; j < 4; j++)
+                {
+                    __m128i words = _mm_loadu_si128((const __m128i *)(block + 16 * j));
+                    v[j] = _mm_and_si128(_mm_srl_epi32(words, _mm_cvtsi32_si128(8 * byte)), mask);
+                }
+                packed = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+            }
+
+            // movemask collects the top bit of each byte; shift each line's bit there in turn
+            int lines = numLines - byte * 8 < 8 ? numLines - byte * 8 : 8;
+            for (int b = 0; b < lines; b++)
+            {
+                if (((lineMask >> (byte * 8 + b)) & 1) == 0)
+                    continue;
+                __m128i shifted = _mm_sll_epi16(packed, _mm_cvtsi32_si128(7 - b));
+                uint16_t bits = uint16_t(_mm_movemask_epi8(shifted));
+                uint64_t &word = planes[byte * 8 + b].words[i >> 6];
+                word |= uint64_t(bits) << (i & 63);
+            }
+        }
+    }
+#endif
+    for (; i < numSamples; i++)
+    {
+        uint32_t sample = 0;
+        std::memcpy(&sample, samples + i * bytesPerSample, bytesPerSample);
+        for (int line = 0; line < numLines; line++)
+        {
+            if ((lineMask >> line) & 1)
+                planes[line].words[i >> 6] |= uint64_t((sample >> line) & 1) << (i & 63);
+        }
+    }
+    return planes;
+}
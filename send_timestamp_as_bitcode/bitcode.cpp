@@ -4,16 +4,76 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
+
+#include "../common/perf_counters.cpp"
+#include "bit_error_monitor.cpp"
+#include "bitcode_format.cpp"
+#include "event_queue.cpp"
+#include "hot_path_guard.cpp"
+#include "loopback_compare.cpp"
+#include "send_latency_histogram.cpp"
+#include "sync_mode_controller.cpp"
 
-constexpr int DIGIT_SAMPLE_HZ = 1000;                            // Hz; apparent sampling rate of digits from Intan
-constexpr int DIGIT_REPEATS = 40;                                // Number of repeated samples for each digit
 constexpr float64 SAMPLE_RATE = DIGIT_SAMPLE_HZ * DIGIT_REPEATS; // Hz; actual sampling rate of NIDAQ
-constexpr int NUM_DIGITS = 68;                                   // Number of digits in binary representation of timestamp (64 for timestamp + 4 for start/end digits)
-constexpr int BITCODE_LENGTH = NUM_DIGITS * DIGIT_REPEATS;       // 64 digits for timestamp + 4 digits for start/end of bitcode, with DIGIT_REPEATS samples for each digit
-constexpr int READ_ARRAY_LENGTH = BITCODE_LENGTH + 1;            // Read 1 sample more than write
-std::atomic<uint64_t> tsInAtomic(0);                             // Thread safe timestamp
+constexpr int MAX_PULSES = MAX_NUM_DIGITS / 2;                   // Most counter pulses of a bitcode, one per HIGH run
+constexpr float64 DIGIT_PERIOD = DIGIT_REPEATS / SAMPLE_RATE;    // s; duration of one digit
+constexpr int PREEMPT_CHECK_SAMPLES = DIGIT_REPEATS;             // Samples read between checks for urgent timestamps
+constexpr int WAKEUP_TIMEOUT_US = 1000;                          // Longest sleep with event wakeup; bounds lost wakeups
+
+/**
+ * @brief Selects how the bitcode is generated by the NI-DAQ board.
+ *
+ * DigitalOutput writes BITCODE_LENGTH hardware-timed samples to a DO line. CounterOutput writes the same waveform as a
+ * buffered pulse train on a counter, needing at most MAX_PULSES high/low duration pairs per bitcode.
+ */
+enum class BitcodeMode
+{
+    DigitalOutput,
+    CounterOutput
+};
+
+/**
+ * @brief Priority class of a queued timestamp; lower classes are always sent first.
+ *
+ * With preemption, an Urgent timestamp also aborts a Normal or Background bitcode in flight.
+ */
+enum class PriorityClass
+{
+    Urgent,
+    Normal,
+    Background
+};
+
+constexpr int NUM_PRIORITY_CLASSES = 3;
+constexpr const char *PRIORITY_CLASS_NAMES[NUM_PRIORITY_CLASSES] = {"urgent", "normal", "background"};
+
+/**
+ * @brief Lets a send be aborted part-way, once an urgent timestamp is queued.
+ */
+struct Preemption
+{
+    const std::atomic<int> *urgentQueued = NULL; // Urgent timestamps waiting to be sent
+    bool aborted = false;                        // Set if the send was aborted; the bitcode was cut short
+};
+
+/**
+ * @brief Outcome of one send, beyond the timestamp read back.
+ */
+struct SendReport
+{
+    uint64_t swHighUS = 0; // CPU time right after the timing edge was written; 0 if it was written by the caller
+    bool verified = false; // The loopback was checked (see the verify parameter of the send functions)
+    bool ok = true;        // The timestamp and tag read back match the ones sent; true if not verified
+    int wrongSamples = 0;  // Samples of the loopback that differ from the bitcode sent
+};
 
 /**
  * @brief Handles error from NI-DAQmx functions.
@@ -45,112 +105,217 @@ uint64_t getCPUClockTimeUS()
 }
 
 /**
- * @brief Converts an integer to a binary string.
+ * @brief Converts an integer to a bitcode array.
+ *
+ * The bitcode array has length format.length(), e.g. BITCODE_LENGTH (BITCODE_LENGTH_FEC with fec). Each digit of
+ * convertIntToDigits is repeated DIGIT_REPEATS times.
  *
  * @param n integer to convert
- * @return std::string
+ * @param bitcodeLength length of bitcode array
+ * @param writeArray array to write bitcode to
+ * @param format frame layout; digits must last DIGIT_REPEATS samples
+ * @param tag source tag, sent if the format has tag digits
  */
-std::string convertIntToBinary(uint64_t n)
+void convertIntToBitcode(uint64_t n, int bitcodeLength, uInt8 *writeArray,
+                         const FrameFormat &format = FrameFormat::timestamp(), uint8_t tag = 0)
 {
-    std::string result;
-    while (n != 0)
+    uInt8 digits[MAX_NUM_DIGITS];
+    int numDigits = convertIntToDigits(n, format, digits, tag);
+
+    // Expand to full bitcode length (each digit is repeated DIGIT_REPEATS times)
+    for (int i = 0; i < numDigits && (i + 1) * DIGIT_REPEATS <= bitcodeLength; i++)
     {
-        result = (n % 2 == 0 ? "0" : "1") + result;
-        n /= 2;
+        for (int j = 0; j < DIGIT_REPEATS; j++)
+        {
+            writeArray[i * DIGIT_REPEATS + j] = digits[i];
+        }
     }
-    return result;
 }
 
 /**
- * @brief Converts an integer to a bitcode array.
+ * @brief Converts an integer to an untagged timestamp bitcode array, optionally with Hamming check digits.
+ */
+void convertIntToBitcode(uint64_t n, int bitcodeLength, uInt8 *writeArray, bool fec)
+{
+    convertIntToBitcode(n, bitcodeLength, writeArray, FrameFormat::timestamp(fec));
+}
+
+/**
+ * @brief Converts an integer to the high/low durations of a counter pulse train.
  *
- * The bitcode array has length BITCODE_LENGTH. The first two bits are "01" and the last two bits are "10", which
- * signify the start/end of a bitcode signal. The middle bits are the binary representation of the integer, padded with
- * leading zeros.
+ * The pulse train reproduces the waveform of convertIntToBitcode. Each pulse covers one run of HIGH digits followed by
+ * the run of LOW digits after it. The leading "0" of the bitcode is produced by the initial delay of the counter
+ * channel, and the trailing "0" is the low time of the last pulse.
  *
  * @param n integer to convert
- * @param bitcodeLength length of bitcode array
- * @param writeArray array to write bitcode to
+ * @param highTimes array of length MAX_PULSES to write the high durations (s) to
+ * @param lowTimes array of length MAX_PULSES to write the low durations (s) to
+ * @param format frame layout; digits must last DIGIT_REPEATS samples
+ * @param tag source tag, sent if the format has tag digits
+ * @return int number of pulses written
  */
-void convertIntToBitcode(uint64_t n, int bitcodeLength, uInt8 *writeArray)
+int convertIntToPulseTimes(uint64_t n, float64 *highTimes, float64 *lowTimes,
+                           const FrameFormat &format = FrameFormat::timestamp(), uint8_t tag = 0)
 {
-    // Convert n to binary string
-    std::string binary = convertIntToBinary(n);
+    uInt8 digits[MAX_NUM_DIGITS];
+    int numDigits = convertIntToDigits(n, format, digits, tag);
 
-    // Pad with leading zeros to NUM_DIGITS-4 digits
-    while (int(binary.length()) < NUM_DIGITS - 4)
+    // Run-length encode, skipping the leading "0"; the remaining digits start with HIGH and end with LOW, so every
+    // HIGH run is followed by a LOW run
+    int numPulses = 0;
+    int i = 1;
+    while (i < numDigits)
     {
-        binary = "0" + binary;
+        int highDigits = 0;
+        while (i < numDigits && digits[i] == 1)
+        {
+            highDigits++;
+            i++;
+        }
+        int lowDigits = 0;
+        while (i < numDigits && digits[i] == 0)
+        {
+            lowDigits++;
+            i++;
+        }
+        highTimes[numPulses] = highDigits * DIGIT_PERIOD;
+        lowTimes[numPulses] = lowDigits * DIGIT_PERIOD;
+        numPulses++;
     }
+    return numPulses;
+}
 
-    // Insert into bitcode,  Set first/last bit to 0 and second/second-to-last bit to 1
-    std::string bitcode = "01" + binary + "10";
+/**
+ * @brief Converts an integer to the pulse train of an untagged timestamp bitcode, optionally with Hamming check digits.
+ */
+int convertIntToPulseTimes(uint64_t n, float64 *highTimes, float64 *lowTimes, bool fec)
+{
+    return convertIntToPulseTimes(n, highTimes, lowTimes, FrameFormat::timestamp(fec));
+}
 
-    // Expand to full bitcode length (each digit is repeated DIGIT_REPEATS times)
-    std::string expanded_bitcode = "";
-    for (int i = 0; i < bitcode.length(); i++)
+/**
+ * @brief Reads a bitcode back from readHw; this triggers the write task.
+ *
+ * With preemption, the read is split into chunks of PREEMPT_CHECK_SAMPLES, and stops after the current chunk once an
+ * urgent timestamp is queued. The tasks must then be stopped as usual, and the abort marker sent.
+ *
+ * @param readHw handle to a hardware read task
+ * @param readArray array to read into
+ * @param readArrayLength number of samples to read
+ * @param preemption if not NULL, aborted is set if the read stopped early
+ */
+inline void readBitcode(TaskHandle &readHw, uInt8 *readArray, int readArrayLength, Preemption *preemption)
+{
+    if (preemption == NULL || preemption->urgentQueued == NULL)
     {
-        for (int j = 0; j < DIGIT_REPEATS; j++)
-        {
-            expanded_bitcode += bitcode[i];
-        }
+        handleError(DAQmxReadDigitalLines(readHw, readArrayLength, 1, DAQmx_Val_GroupByChannel, readArray,
+                                          readArrayLength, NULL, NULL, NULL));
+        return;
     }
 
-    // Convert to uInt8 array
-    for (int i = 0; i < int(expanded_bitcode.length()); i++)
+    // The first chunk always starts the bitcode, so an abort always leaves a partial frame followed by the marker
+    int samplesRead = 0;
+    while (samplesRead < readArrayLength)
     {
-        if (expanded_bitcode[i] == '0')
-        {
-            writeArray[i] = 0;
-        }
-        else
+        if (samplesRead > 0 && preemption->urgentQueued->load(std::memory_order_relaxed) > 0)
         {
-            writeArray[i] = 1;
+            preemption->aborted = true;
+            return;
         }
+        int32 chunkRead = 0;
+        int chunk = std::min(PREEMPT_CHECK_SAMPLES, readArrayLength - samplesRead);
+        handleError(DAQmxReadDigitalLines(readHw, chunk, 1, DAQmx_Val_GroupByChannel, readArray + samplesRead,
+                                          readArrayLength - samplesRead, &chunkRead, NULL, NULL));
+        samplesRead += chunkRead;
     }
 }
 
 /**
- * @brief Converts a bitcode array to an integer.
+ * @brief Sends the abort marker (see writeAbortMarker) after a bitcode was cut short.
  *
- * @param readArray array of bits read from read_hw task. Should have length BITCODE_LENGTH+1.
- * @return uint64_t
+ * The hardware tasks are sized for one bitcode, so they are resized for the marker and back. A second line of
+ * writeHw (the hardware timing marker) is held LOW.
+ *
+ * @param writeHw handle to a stopped hardware write task with one or two lines; the bitcode line comes first
+ * @param readHw handle to a stopped hardware read task
+ * @param bitcodeLength number of samples per bitcode that the tasks are sized for
  */
-uint64_t convertReadArrayToInt(uInt8 *readArray)
+void sendAbortMarker(TaskHandle &writeHw, TaskHandle &readHw, int bitcodeLength)
 {
-    // Convert array to binary string, ignoring first/last bits that are always HIGH. Note that in the bitcode, these
-    // refer to the second/second-to-last bit bits.
-    std::string expanded_binary;
-    for (int i = 1; i < READ_ARRAY_LENGTH; i++)
+    // Grouped by channel, so the second line (if any) is all LOW
+    uInt8 writeArray[2 * ABORT_MARKER_LENGTH] = {};
+    uInt8 readArray[ABORT_MARKER_LENGTH + 1];
+    writeAbortMarker(writeArray);
+
+    handleError(
+        DAQmxCfgSampClkTiming(writeHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, ABORT_MARKER_LENGTH));
+    handleError(DAQmxCfgSampClkTiming(readHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+                                      ABORT_MARKER_LENGTH + 1));
+    handleError(DAQmxWriteDigitalLines(writeHw, ABORT_MARKER_LENGTH, true, 1, DAQmx_Val_GroupByChannel, writeArray, 0,
+                                       NULL));
+    handleError(DAQmxReadDigitalLines(readHw, ABORT_MARKER_LENGTH + 1, 1, DAQmx_Val_GroupByChannel, readArray,
+                                      sizeof(readArray), NULL, NULL, NULL));
+    handleError(DAQmxStopTask(writeHw));
+    handleError(DAQmxStopTask(readHw));
+
+    handleError(
+        DAQmxCfgSampClkTiming(writeHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, bitcodeLength));
+    handleError(
+        DAQmxCfgSampClkTiming(readHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, bitcodeLength + 1));
+}
+
+/**
+ * @brief Verifies the loopback of a bitcode, shared by all send paths.
+ *
+ * Every sample read is compared with the sample written; the read task data trails the write task by 1 sample. Only a
+ * bitcode with wrong samples is converted back to a timestamp, to tell whether it can still be decoded.
+ *
+ * @param written samples of the bitcode as written (or as the counter generates them)
+ * @param readArray samples read back, format.length() + 1 of them
+ * @param report if not NULL, set to the result of the verification
+ * @return uint64_t timestamp read back
+ */
+uint64_t verifyLoopback(uint64_t tsIn,
+                        const uInt8 *written,
+                        const uInt8 *readArray,
+                        const FrameFormat &format,
+                        uint8_t tag,
+                        StageMetrics *metrics,
+                        BitErrorMonitor *errors,
+                        SendReport *report)
+{
+    uint64_t tsOut = tsIn & format.dataMask();
+    uint8_t tagOut = tag;
+    LoopbackMismatch mismatch;
     {
-        if (readArray[i] == 0)
-        {
-            expanded_binary += "0";
-        }
-        else
-        {
-            expanded_binary += "1";
-        }
+        PerfStageScope stage(metrics, "verify");
+        HOT_PATH_SCOPE("verify");
+        uint64_t wrongSamples[LOOPBACK_MASK_WORDS];
+        mismatch = compareLoopback(written, readArray + 1, format.length(), errors != NULL ? wrongSamples : NULL);
+        if (mismatch.count != 0)
+            tsOut = convertReadArrayToInt(readArray, format, &tagOut);
+        if (errors != NULL)
+            errors->record(wrongSamples, mismatch, format.length());
     }
 
-    // Shorten expanded_binary, taking every DIGIT_REPEATS'th value
-    std::string binary = "";
-    for (int i = 0; i < expanded_binary.length(); i += DIGIT_REPEATS)
+    // Compare tsIn and tsOut
+    if (mismatch.count != 0)
     {
-        binary += expanded_binary[i];
+        std::cout << "Loopback mismatch for timestamp: " << tsIn << ": " << mismatch << std::endl;
     }
-
-    // Convert binary string to int
-    // Because binary string starts with "01" and ends with "10", which are the first/last two bits of the bitcode that
-    // signify the start/end of the bitcode, we want to ignore those when converting to the timestamp, so index from 2 and
-    // go to length-2.
-    uint64_t n = 0;
-    for (int i = 2; i < int(binary.length()) - 2; i++)
+    bool ok = (tsIn & format.dataMask()) == tsOut && tagOut == tag;
+    if (report != NULL)
+    {
+        report->verified = true;
+        report->ok = ok;
+        report->wrongSamples = mismatch.count;
+    }
+    if (!ok)
     {
-        n = n * 2 + binary[i] - '0';
+        std::cout << "Failure for timestamp: " << tsIn << std::endl;
     }
 
-    return n;
+    return tsOut;
 }
 
 /**
@@ -163,13 +328,30 @@ uint64_t convertReadArrayToInt(uInt8 *readArray)
  * @param readHw handle to a hardware read task
  * @param writeSw handle to a software write task
  * @param readSw  handle to a software read task
- * @return uint64_t
+ * @param format frame layout; tasks must be sized for format.length()
+ * @param tag source tag, sent if the format has tag digits
+ * @param metrics if not NULL, perf counters are sampled around each stage of the send
+ * @param preemption if not NULL, the send is aborted once an urgent timestamp is queued
+ * @param errors if not NULL, every sample read back is compared with the bitcode sent
+ * @param verify whether to compare the bitcode read back with the one sent; if not, the timestamp sent is returned
+ * @param swHighWritten whether the software HIGH was already written (see BitcodeSender::markNow); only the LOW is
+ * written then
+ * @param report if not NULL, set to the time of the software HIGH and the result of the verification
+ * @return uint64_t timestamp read back; 0 if aborted
  */
 uint64_t sendTimestampAsBitcodePulse(uint64_t tsIn,
                                      TaskHandle &writeHw,
                                      TaskHandle &readHw,
                                      TaskHandle &writeSw,
-                                     TaskHandle &readSw)
+                                     TaskHandle &readSw,
+                                     const FrameFormat &format = FrameFormat::timestamp(),
+                                     uint8_t tag = 0,
+                                     StageMetrics *metrics = NULL,
+                                     Preemption *preemption = NULL,
+                                     BitErrorMonitor *errors = NULL,
+                                     bool verify = true,
+                                     bool swHighWritten = false,
+                                     SendReport *report = NULL)
 {
     /////////////////
     /*Software HIGH*/
@@ -179,9 +361,15 @@ uint64_t sendTimestampAsBitcodePulse(uint64_t tsIn,
     // the timing signal on the intan board.
 
     uInt8 swWrite1[1] = {1};
-    handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    if (!swHighWritten)
+    {
+        PerfStageScope stage(metrics, "swHigh");
+        handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    }
     [[maybe_unused]] uint64_t swTime = getCPUClockTimeUS();
-    // std::cout << "swT: " << swTime - tsInAtomic << "us" << std::endl;
+    // std::cout << "swT: " << swTime - tsIn << "us" << std::endl;
+    if (report != NULL)
+        *report = SendReport{swHighWritten ? 0 : swTime};
 
     ////////////////////////////////
     /*Hardware timed bitcode pulse*/
@@ -191,20 +379,35 @@ uint64_t sendTimestampAsBitcodePulse(uint64_t tsIn,
     // PC state data.
 
     // Convert timestamp to bitcode
-    uInt8 writeArray[BITCODE_LENGTH];
-    convertIntToBitcode(tsIn, BITCODE_LENGTH, writeArray);
+    int bitcodeLength = format.length();
+    uInt8 writeArray[MAX_BITCODE_LENGTH];
+    {
+        PerfStageScope stage(metrics, "encode");
+        HOT_PATH_SCOPE("encode");
+        convertIntToBitcode(tsIn, bitcodeLength, writeArray, format, tag);
+    }
 
     // Write bitcode; does not write until triggered by start of read task
-    handleError(DAQmxWriteDigitalLines(writeHw, BITCODE_LENGTH, true, 1, DAQmx_Val_GroupByChannel, writeArray, 0, NULL));
+    {
+        PerfStageScope stage(metrics, "writeHw");
+        handleError(
+            DAQmxWriteDigitalLines(writeHw, bitcodeLength, true, 1, DAQmx_Val_GroupByChannel, writeArray, 0, NULL));
+    }
 
     // Read written bitcode; this triggers the write task. The read task data trails the write task by 1 sample.
-    uInt8 readArray[READ_ARRAY_LENGTH];
-    handleError(DAQmxReadDigitalLines(readHw, READ_ARRAY_LENGTH, 1, DAQmx_Val_GroupByChannel, readArray,
-                                      sizeof(readArray), NULL, NULL, NULL));
+    int readArrayLength = format.length() + 1;
+    uInt8 readArray[MAX_READ_ARRAY_LENGTH];
+    {
+        PerfStageScope stage(metrics, "readHw");
+        readBitcode(readHw, readArray, readArrayLength, preemption);
+    }
 
     // Stop hardware tasks - necessary to be retriggerable
-    handleError(DAQmxStopTask(writeHw));
-    handleError(DAQmxStopTask(readHw));
+    {
+        PerfStageScope stage(metrics, "stopHw");
+        handleError(DAQmxStopTask(writeHw));
+        handleError(DAQmxStopTask(readHw));
+    }
 
     ////////////////
     /*Software LOW*/
@@ -212,100 +415,897 @@ uint64_t sendTimestampAsBitcodePulse(uint64_t tsIn,
 
     // Write LOW for timing signal; indicates the end of the timing signal
     swWrite1[0] = {0};
-    handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    {
+        PerfStageScope stage(metrics, "swLow");
+        handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    }
 
     // Read - not necesary for logic of code, but suppresses cmake warning of unsued readSw
     uInt8 swRead1[1] = {0};
     handleError(
         DAQmxReadDigitalLines(readSw, 1, 1, DAQmx_Val_GroupByChannel, swRead1, sizeof(swRead1), NULL, NULL, NULL));
 
+    // An aborted bitcode is not verified; the caller sends the abort marker
+    if (preemption != NULL && preemption->aborted)
+    {
+        return 0;
+    }
+
     /////////////////////////////////////////////
     /*Compare timestamp sent and timestamp read*/
     /////////////////////////////////////////////
 
-    // Convert back to timestamp
-    uint64_t tsOut = convertReadArrayToInt(readArray);
-
-    // Compare tsIn and tsOut
-    if (tsIn != tsOut)
+    // With sampled verification, most bitcodes are not checked
+    if (!verify)
     {
-        std::cout << "Failure for timestamp: " << tsIn << std::endl;
+        return tsIn & format.dataMask();
     }
 
-    return tsOut;
+    return verifyLoopback(tsIn, writeArray, readArray, format, tag, metrics, errors, report);
 }
 
 /**
- * @brief Initializes NIDAQ tasks and sends bitcode pulses as new timestamps are received.
+ * @brief Sends a timestamp as a bitcode pulse train using a counter output of the NI-DAQ board.
  *
- * This function operates as a separate thread. When it detects a changes in the atomic variable tsInAtomic, it sends
- * the bitcode.
+ * Identical to sendTimestampAsBitcodePulse, except that the bitcode is generated by the counter task writeCtr from at
+ * most MAX_PULSES high/low duration pairs instead of BITCODE_LENGTH DO samples. The counter output must be wired to
+ * the DI line of readHw so that the bitcode can still be verified.
  *
- * @param keepSendingBitcodeFlag_ptr pointer to atomic bool that controls whether to keep sending bitcode
+ * @param writeCtr handle to a counter output task, triggered by the start of readHw
+ * @param readHw handle to a hardware read task
+ * @param writeSw handle to a software write task
+ * @param readSw  handle to a software read task
+ * @param format frame layout; tasks must be sized for format.length()
+ * @param tag source tag, sent if the format has tag digits
+ * @param metrics if not NULL, perf counters are sampled around each stage of the send
+ * @param errors if not NULL, every sample read back is compared with the bitcode the counter should generate
+ * @param verify whether to compare the bitcode read back with the one sent; if not, the timestamp sent is returned
+ * @param swHighWritten whether the software HIGH was already written (see BitcodeSender::markNow)
+ * @param report if not NULL, set to the time of the software HIGH and the result of the verification
+ * @param configuredPulses if not NULL, the number of pulses writeCtr is configured for; the task is then only resized
+ * for a bitcode with a different number of pulses, and the number is updated
+ * @return uint64_t
  */
-void bitcodeSender(std::atomic<bool> *keepSendingBitcodeFlag_ptr)
+uint64_t sendTimestampAsCounterPulse(uint64_t tsIn,
+                                     TaskHandle &writeCtr,
+                                     TaskHandle &readHw,
+                                     TaskHandle &writeSw,
+                                     TaskHandle &readSw,
+                                     const FrameFormat &format = FrameFormat::timestamp(),
+                                     uint8_t tag = 0,
+                                     StageMetrics *metrics = NULL,
+                                     BitErrorMonitor *errors = NULL,
+                                     bool verify = true,
+                                     bool swHighWritten = false,
+                                     SendReport *report = NULL,
+                                     int *configuredPulses = NULL)
 {
-    ////////////////////////
-    /* Initialize Channels*/
-    ////////////////////////
-
-    // Create hardware read task and DI channel
-    TaskHandle readHw;
-    handleError(DAQmxCreateTask("readHw", &readHw));
-    handleError(DAQmxCreateDIChan(readHw, "Dev2/port0/line0", "channel0", DAQmx_Val_ChanForAllLines));
-    handleError(
-        DAQmxCfgSampClkTiming(readHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, READ_ARRAY_LENGTH));
-
-    // Create hardware write task and DO channel; trigger with readHw start
-    TaskHandle writeHw;
-    handleError(DAQmxCreateTask("writeHw", &writeHw));
-    handleError(DAQmxCreateDOChan(writeHw, "Dev2/port0/line1", "channel1", DAQmx_Val_ChanForAllLines));
-    handleError(DAQmxCfgSampClkTiming(writeHw, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, BITCODE_LENGTH));
-    handleError(DAQmxCfgDigEdgeStartTrig(writeHw, "/Dev2/di/StartTrigger", DAQmx_Val_Rising));
-
-    // Create software read task and DI channel
-    TaskHandle readSw;
-    handleError(DAQmxCreateTask("readSw", &readSw));
-    handleError(DAQmxCreateDIChan(readSw, "Dev2/port0/line2", "channel2", DAQmx_Val_ChanForAllLines));
-
-    // Create software write task and DO channel
-    TaskHandle writeSw;
-    handleError(DAQmxCreateTask("writeSw", &writeSw));
-    handleError(DAQmxCreateDOChan(writeSw, "Dev2/port0/line3", "channel3", DAQmx_Val_ChanForAllLines));
-
-    // Initial software read/write; makes subsequent sw read/writes much faster
-    uInt8 swRead1[1] = {0};
-    uInt8 swWrite1[1] = {0};
+    /////////////////
+    /*Software HIGH*/
+    /////////////////
+
+    uInt8 swWrite1[1] = {1};
+    if (!swHighWritten)
+    {
+        PerfStageScope stage(metrics, "swHigh");
+        handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    }
+    if (report != NULL)
+        *report = SendReport{swHighWritten ? 0 : getCPUClockTimeUS()};
+
+    //////////////////////////////////
+    /*Hardware timed bitcode pulses*/
+    //////////////////////////////////
+
+    // Convert timestamp to pulse durations
+    float64 highTimes[MAX_PULSES];
+    float64 lowTimes[MAX_PULSES];
+    int numPulses;
+    {
+        PerfStageScope stage(metrics, "encode");
+        HOT_PATH_SCOPE("encode");
+        numPulses = convertIntToPulseTimes(tsIn, highTimes, lowTimes, format, tag);
+    }
 
-    // write LOW;read one sample
-    handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    // The number of pulses depends on the timestamp; extra pulses would show up on the line, so the finite pulse train
+    // is resized, but only when the number differs from the last bitcode
+    if (configuredPulses == NULL || *configuredPulses != numPulses)
+    {
+        handleError(DAQmxCfgImplicitTiming(writeCtr, DAQmx_Val_FiniteSamps, numPulses));
+        if (configuredPulses != NULL)
+            *configuredPulses = numPulses;
+    }
+
+    // Write pulse train; does not generate until triggered by start of read task
+    {
+        PerfStageScope stage(metrics, "writeHw");
+        handleError(
+            DAQmxWriteCtrTime(writeCtr, numPulses, true, 1, DAQmx_Val_GroupByChannel, highTimes, lowTimes, NULL, NULL));
+    }
+
+    // Read generated bitcode; this triggers the counter task
+    int readArrayLength = format.length() + 1;
+    uInt8 readArray[MAX_READ_ARRAY_LENGTH];
+    {
+        PerfStageScope stage(metrics, "readHw");
+        handleError(DAQmxReadDigitalLines(readHw, readArrayLength, 1, DAQmx_Val_GroupByChannel, readArray,
+                                          sizeof(readArray), NULL, NULL, NULL));
+    }
+
+    // Stop hardware tasks - necessary to be retriggerable
+    {
+        PerfStageScope stage(metrics, "stopHw");
+        handleError(DAQmxStopTask(writeCtr));
+        handleError(DAQmxStopTask(readHw));
+    }
+
+    ////////////////
+    /*Software LOW*/
+    ////////////////
+
+    swWrite1[0] = {0};
+    {
+        PerfStageScope stage(metrics, "swLow");
+        handleError(DAQmxWriteDigitalLines(writeSw, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+    }
+
+    uInt8 swRead1[1] = {0};
     handleError(
         DAQmxReadDigitalLines(readSw, 1, 1, DAQmx_Val_GroupByChannel, swRead1, sizeof(swRead1), NULL, NULL, NULL));
 
-    ////////////////////////////////
-    /*Transmit Timestamp as Pulses*/
-    ////////////////////////////////
+    /////////////////////////////////////////////
+    /*Compare timestamp sent and timestamp read*/
+    /////////////////////////////////////////////
+
+    // With sampled verification, most bitcodes are not checked
+    if (!verify)
+    {
+        return tsIn & format.dataMask();
+    }
 
-    // tsPrev is used to check if the timestamp has changed
-    uint64_t tsPrev = tsInAtomic;
+    // The counter has no sample buffer; compare with the DO samples of the same bitcode
+    uInt8 expected[MAX_BITCODE_LENGTH];
+    convertIntToBitcode(tsIn, format.length(), expected, format, tag);
+    return verifyLoopback(tsIn, expected, readArray, format, tag, metrics, errors, report);
+}
 
-    // Loop until timestamp changes
-    while (*keepSendingBitcodeFlag_ptr)
+/**
+ * @brief Sends a timestamp as a bitcode pulse with a hardware-timed timing marker.
+ *
+ * Instead of a software HIGH/LOW, the timing marker is a second line in the same hardware-timed DO task as the
+ * bitcode. The marker is HIGH from the first sample of the bitcode until its trailing "0" digit, so its rising edge
+ * has a fixed, sample-exact offset (zero) from the start of the bitcode, independent of driver latency. This also
+ * saves the two software writes per send.
+ *
+ * @param writeHw handle to a hardware write task with two channels: the bitcode line, then the marker line
+ * @param readHw handle to a hardware read task
+ * @param format frame layout; tasks must be sized for format.length()
+ * @param tag source tag, sent if the format has tag digits
+ * @param metrics if not NULL, perf counters are sampled around each stage of the send
+ * @param preemption if not NULL, the send is aborted once an urgent timestamp is queued
+ * @param errors if not NULL, every sample read back is compared with the bitcode sent
+ * @param verify whether to compare the bitcode read back with the one sent; if not, the timestamp sent is returned
+ * @param report if not NULL, set to the time the hardware tasks were started (the marker edge follows within the
+ * start latency) and the result of the verification
+ * @return uint64_t timestamp read back; 0 if aborted
+ */
+uint64_t sendTimestampWithHardwareMarker(uint64_t tsIn,
+                                         TaskHandle &writeHw,
+                                         TaskHandle &readHw,
+                                         const FrameFormat &format = FrameFormat::timestamp(),
+                                         uint8_t tag = 0,
+                                         StageMetrics *metrics = NULL,
+                                         Preemption *preemption = NULL,
+                                         BitErrorMonitor *errors = NULL,
+                                         bool verify = true,
+                                         SendReport *report = NULL)
+{
+    ////////////////////////////////////////////
+    /*Hardware timed bitcode and timing marker*/
+    ////////////////////////////////////////////
+
+    // Channel 0 carries the bitcode and channel 1 the marker (grouped by channel)
+    int bitcodeLength = format.length();
+    uInt8 writeArray[2 * MAX_BITCODE_LENGTH];
     {
-        // If timestamp has changed, send bitcode pulse
-        if (tsInAtomic != tsPrev)
+        PerfStageScope stage(metrics, "encode");
+        HOT_PATH_SCOPE("encode");
+        convertIntToBitcode(tsIn, bitcodeLength, writeArray, format, tag);
+        uInt8 *marker = writeArray + bitcodeLength;
+        for (int i = 0; i < bitcodeLength; i++)
         {
-            uint64_t tsIn = tsInAtomic;
-            sendTimestampAsBitcodePulse(tsIn, writeHw, readHw, writeSw, readSw);
+            marker[i] = (i < bitcodeLength - DIGIT_REPEATS) ? 1 : 0;
+        }
+    }
 
-            [[maybe_unused]] uint64_t tsFinal = getCPUClockTimeUS();
+    // Write bitcode and marker; does not write until triggered by start of read task
+    {
+        PerfStageScope stage(metrics, "writeHw");
+        handleError(
+            DAQmxWriteDigitalLines(writeHw, bitcodeLength, true, 1, DAQmx_Val_GroupByChannel, writeArray, 0, NULL));
+    }
 
-            // std::cout << "RTT: " << tsFinal - tsInAtomic << "us" << std::endl;
+    // Read written bitcode; this triggers the write task. The read task data trails the write task by 1 sample.
+    int readArrayLength = format.length() + 1;
+    uInt8 readArray[MAX_READ_ARRAY_LENGTH];
+    if (report != NULL)
+        *report = SendReport{getCPUClockTimeUS()};
+    {
+        PerfStageScope stage(metrics, "readHw");
+        readBitcode(readHw, readArray, readArrayLength, preemption);
+    }
 
-            // Print variables
-            // std::cout << "**********************" << std::endl;
-            tsPrev = tsIn;
-        }
-        std::this_thread::sleep_for(std::chrono::microseconds(10)); // Allow time on other threads
+    // Stop hardware tasks - necessary to be retriggerable
+    {
+        PerfStageScope stage(metrics, "stopHw");
+        handleError(DAQmxStopTask(writeHw));
+        handleError(DAQmxStopTask(readHw));
+    }
+
+    // An aborted bitcode is not verified; the caller sends the abort marker
+    if (preemption != NULL && preemption->aborted)
+    {
+        return 0;
     }
+
+    /////////////////////////////////////////////
+    /*Compare timestamp sent and timestamp read*/
+    /////////////////////////////////////////////
+
+    // With sampled verification, most bitcodes are not checked
+    if (!verify)
+    {
+        return tsIn & format.dataMask();
+    }
+
+    // Channel 0 of writeArray is the bitcode
+    return verifyLoopback(tsIn, writeArray, readArray, format, tag, metrics, errors, report);
 }
+
+/**
+ * @brief Selects the order in which a BitcodeSender with several sources sends their queued timestamps.
+ *
+ * RoundRobin takes one timestamp from each source with queued timestamps in turn, so a busy source cannot starve the
+ * others. Priority always sends from the lowest-numbered source with queued timestamps first, so source 0 has the
+ * lowest latency.
+ */
+enum class SourceScheduling
+{
+    RoundRobin,
+    Priority
+};
+
+/**
+ * @brief Configuration of one BitcodeSender.
+ *
+ * Lines are given relative to the device. readHwLine must be physically connected to writeHwLine (or to the counter
+ * output in BitcodeMode::CounterOutput), and readSwLine to writeSwLine. With hardwareMarker, writeSwLine carries the
+ * timing marker as part of the hardware-timed DO task and readSwLine is unused.
+ */
+struct BitcodeSenderConfig
+{
+    std::string name = "bitcode";        // Prefix of the task names; must be unique per process
+    std::string device = "Dev2";
+    std::string readHwLine = "port0/line0";
+    std::string writeHwLine = "port0/line1";
+    std::string readSwLine = "port0/line2";
+    std::string writeSwLine = "port0/line3";
+    std::string counter = "ctr1";        // Counter generating the bitcode in BitcodeMode::CounterOutput
+    BitcodeMode mode = BitcodeMode::DigitalOutput;
+    bool fec = false;                    // Append Hamming check digits to the bitcode
+    int numSources = 1;                  // Producers (1 to NUM_SOURCES); above 1, bitcodes carry the source as a tag
+    SourceScheduling scheduling = SourceScheduling::RoundRobin; // Order of sources within a priority class
+    bool preemption = false;             // Urgent timestamps abort lower-class bitcodes in flight; DigitalOutput only
+    bool reportLatency = false;          // Print the latency of each priority class on stop()
+    bool trackBitErrors = false;         // Compare every sample read back with the bitcode sent; reported on stop()
+    bool hardwareMarker = false;         // Emit the timing marker in the DO sample stream; DigitalOutput mode only
+    bool perfCounters = false;           // Sample perf counters around each stage of a send; reported on stop()
+    std::string perfTracePath;           // If not empty, also write every perf sample to this CSV file
+    size_t queueCapacity = 64;           // Timestamps that can wait to be sent, per source and priority class
+    bool adaptive = false;               // Let a SyncModeController switch short codes, sampled verify and wakeup
+    SyncModeControllerConfig control;    // Targets and allowed modes of the controller, with config.adaptive
+    bool completions = false;            // Report every sent timestamp back to its source (see pollCompletion)
+};
+
+/**
+ * @brief Timestamp waiting in a BitcodeSender queue, with the time it was queued.
+ */
+struct QueuedTimestamp
+{
+    uint64_t tsIn;
+    uint64_t queuedUS;
+};
+
+/**
+ * @brief Sent timestamp, reported back to its source by a BitcodeSender with config.completions.
+ */
+struct SendCompletion
+{
+    uint64_t tsIn;
+    uint64_t swHighUS;     // CPU time of the timing edge (for a mark, the time returned by markNow())
+    uint64_t queueDelayUS; // From send() to the start of the bitcode
+    bool verified;         // The loopback was checked; not every bitcode is with sampled verification
+    bool ok;               // The loopback matched, or was not checked
+    int wrongSamples;      // Samples of the loopback that differ from the bitcode sent
+};
+
+/**
+ * @brief Owner of the software timing line of a BitcodeSender, which carries one HIGH at a time.
+ */
+enum class SoftwareLine
+{
+    Free,    // LOW; markNow() may write the next HIGH
+    Sender,  // Held by the sender thread for a bitcode, or the tasks do not exist
+    Marking, // markNow() is writing the HIGH
+    Marked   // HIGH from markNow(); its bitcode waits for the sender thread
+};
+
+/**
+ * @brief Sends timestamps as bitcodes on one sync channel, from its own thread.
+ *
+ * Each sender owns its queues, NI-DAQ tasks, thread and configuration, so one process can drive independent sync
+ * channels on different lines or devices. Instances are aligned to cache lines so that senders do not contend on
+ * shared state.
+ *
+ * Several producers can share the line: each source has its own queue, the sender interleaves them according to
+ * config.scheduling, and every bitcode carries its source as a tag (protected by the check digits with fec), so the
+ * decoder can demultiplex them again (see demultiplexByTag).
+ *
+ * Each source has one queue per PriorityClass, and lower classes are always sent first. A Normal or Background
+ * bitcode in flight would still delay an Urgent timestamp by up to a whole bitcode; with config.preemption it is
+ * instead cut short within PREEMPT_CHECK_SAMPLES, followed by the abort marker (so decoders can skip the partial
+ * frame, see findFrameStarts), and sent again after the urgent ones. The latency from send() to the start of the
+ * bitcode is recorded per class.
+ *
+ * With config.adaptive, a SyncModeController picks the mode between bitcodes from the queue depth, latency and bit
+ * error rate: short codes (only the low SHORT_TIMESTAMP_BITS bits, with a full code every FULL_CODE_INTERVAL bitcodes
+ * so the decoder can restore the high bits, see decodeAdaptiveFrames), verification of every n-th bitcode only, and
+ * sleeping until a timestamp is queued instead of polling.
+ *
+ * markNow() writes the software HIGH on the caller's thread instead, right at the caller's event, and leaves only the
+ * bitcode to the sender thread, which sends it ahead of all queued timestamps.
+ *
+ * With config.completions, every timestamp sent is reported back to its source, with the time of its timing edge,
+ * its queueing delay and the result of the loopback check, so producers can log emission times as they happen (see
+ * pollCompletion).
+ */
+class alignas(CACHE_LINE_SIZE) BitcodeSender
+{
+public:
+    explicit BitcodeSender(BitcodeSenderConfig config)
+        : config_(std::move(config)), controller_(config_.name, config_.control)
+    {
+        if (config_.numSources < 1 || config_.numSources > NUM_SOURCES)
+        {
+            std::cout << config_.name << ": numSources must be between 1 and " << NUM_SOURCES << "; using 1"
+                      << std::endl;
+            config_.numSources = 1;
+        }
+        for (int i = 0; i < NUM_PRIORITY_CLASSES * config_.numSources; i++)
+        {
+            queues_.emplace_back(new EventQueue<QueuedTimestamp>(config_.queueCapacity));
+        }
+        for (int i = 0; config_.completions && i < config_.numSources; i++)
+        {
+            completions_.emplace_back(new EventQueue<SendCompletion>(config_.queueCapacity));
+        }
+        if (config_.hardwareMarker && config_.mode != BitcodeMode::DigitalOutput)
+        {
+            std::cout << config_.name << ": hardware marker requires BitcodeMode::DigitalOutput; using software marker"
+                      << std::endl;
+            config_.hardwareMarker = false;
+        }
+        if (config_.preemption && config_.mode != BitcodeMode::DigitalOutput)
+        {
+            std::cout << config_.name << ": preemption requires BitcodeMode::DigitalOutput; disabled" << std::endl;
+            config_.preemption = false;
+        }
+    }
+
+    ~BitcodeSender() { stop(); }
+
+    BitcodeSender(const BitcodeSender &) = delete;
+    BitcodeSender &operator=(const BitcodeSender &) = delete;
+
+    /**
+     * @brief Starts the sender thread, which creates the NI-DAQ tasks and then sends queued timestamps.
+     */
+    void start()
+    {
+        if (thread_.joinable())
+            return;
+        keepSending_ = true;
+        thread_ = std::thread(&BitcodeSender::run, this);
+    }
+
+    /**
+     * @brief Stops the sender thread after the bitcode in flight, and clears the NI-DAQ tasks.
+     */
+    void stop()
+    {
+        keepSending_ = false;
+        wake_.notify_one();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    /**
+     * @brief Queues a timestamp to be sent; safe to call from any thread, does not block.
+     *
+     * @param tsIn timestamp
+     * @param source producer of the timestamp, from 0 to config.numSources - 1; sent as the tag of the bitcode
+     * @param priority priority class of the timestamp
+     * @return false if the queue is full and the timestamp was dropped, or if the source is out of range
+     */
+    bool send(uint64_t tsIn, int source = 0, PriorityClass priority = PriorityClass::Normal)
+    {
+        if (source < 0 || source >= config_.numSources)
+            return false;
+        int priorityClass = int(priority);
+        if (!queues_[priorityClass * config_.numSources + source]->push({tsIn, getCPUClockTimeUS()}))
+            return false;
+        if (priority == PriorityClass::Urgent)
+            urgentQueued_.fetch_add(1, std::memory_order_relaxed);
+        wakeSender();
+        return true;
+    }
+
+    /**
+     * @brief Writes the software HIGH on the calling thread and returns its time; the bitcode carrying that time is
+     * encoded and sent by the sender thread, ahead of all queued timestamps (as an urgent one).
+     *
+     * The timing edge then follows the caller's event by a single software write, without waiting for the sender
+     * thread to wake up. The software line carries one HIGH at a time, so nothing is written while the bitcode of an
+     * earlier timestamp or mark is in flight; queue the timestamp with send() then.
+     *
+     * @param source producer of the timestamp, from 0 to config.numSources - 1; sent as the tag of the bitcode
+     * @return uint64_t timestamp of the HIGH (CPU clock, middle of the write); 0 if the software line is busy, the
+     * sender is not running, config.hardwareMarker is set (the marker is hardware-timed), or the source is out of range
+     */
+    uint64_t markNow(int source = 0)
+    {
+        if (source < 0 || source >= config_.numSources)
+            return 0;
+        SoftwareLine state = SoftwareLine::Free;
+        if (!swLine_.compare_exchange_strong(state, SoftwareLine::Marking))
+            return 0;
+
+        // The task was pre-warmed by the sender thread, so this write is as fast as its own software HIGH
+        uInt8 swWrite1[1] = {1};
+        uint64_t before = getCPUClockTimeUS();
+        handleError(DAQmxWriteDigitalLines(writeSw_, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+        uint64_t after = getCPUClockTimeUS();
+        uint64_t tsIn = before + (after - before) / 2;
+
+        mark_ = {tsIn, tsIn};
+        markSource_ = uint8_t(source);
+        swLine_.store(SoftwareLine::Marked);
+        wakeSender();
+        return tsIn;
+    }
+
+    /**
+     * @brief Takes the oldest completion of a source, with config.completions; does not block.
+     *
+     * Completions arrive in the order the timestamps of the source were sent. Each source must be polled from one
+     * thread at a time; completions that do not fit in its queue (config.queueCapacity) are dropped and counted.
+     *
+     * @param completion set to the completion
+     * @param source producer, from 0 to config.numSources - 1
+     * @return false if no completion is waiting
+     */
+    bool pollCompletion(SendCompletion &completion, int source = 0)
+    {
+        if (source < 0 || source >= int(completions_.size()))
+            return false;
+        return completions_[source]->pop(completion);
+    }
+
+    /**
+     * @return uint64_t completions dropped because the queue of their source was full
+     */
+    uint64_t droppedCompletions() const { return droppedCompletions_.load(std::memory_order_relaxed); }
+
+    const BitcodeSenderConfig &config() const { return config_; }
+
+    /**
+     * @brief Latency from send() to the start of the bitcode, for the timestamps of one priority class.
+     *
+     * Read it only while the sender is stopped.
+     */
+    const SendLatencyHistogram &latency(PriorityClass priority) const { return latency_[int(priority)]; }
+
+    /**
+     * @brief Bit error statistics of the sync line, with config.trackBitErrors.
+     *
+     * The rolling error rates may be read at any time; read the other statistics only while the sender is stopped.
+     */
+    const BitErrorMonitor &bitErrors() const { return bitErrors_; }
+
+    /**
+     * @brief Current mode of the sender; changes only with config.adaptive. Read it only while the sender is stopped.
+     */
+    const SyncMode &mode() const { return controller_.mode(); }
+
+private:
+    std::string taskName(const char *task) const { return config_.name + "_" + task; }
+    std::string physical(const std::string &line) const { return config_.device + "/" + line; }
+
+    /**
+     * @brief Takes the next timestamp to send: from the lowest priority class with queued timestamps (an aborted one
+     * first), and within that class from the sources according to config.scheduling.
+     *
+     * @return false if all queues are empty
+     */
+    bool popNext(QueuedTimestamp &event, uint8_t &source, int &priorityClass)
+    {
+        int numSources = config_.numSources;
+        for (int c = 0; c < NUM_PRIORITY_CLASSES; c++)
+        {
+            if (hasRetry_ && retryClass_ == c)
+            {
+                hasRetry_ = false;
+                event = retry_;
+                source = retrySource_;
+                priorityClass = c;
+                return true;
+            }
+            for (int i = 0; i < numSources; i++)
+            {
+                int s = config_.scheduling == SourceScheduling::Priority ? i : (nextSource_[c] + i) % numSources;
+                if (queues_[c * numSources + s]->pop(event))
+                {
+                    source = uint8_t(s);
+                    priorityClass = c;
+                    nextSource_[c] = (s + 1) % numSources;
+                    if (c == int(PriorityClass::Urgent))
+                        urgentQueued_.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Takes the next timestamp to send: a mark first, then as popNext. Unless config.hardwareMarker, it also
+     * claims the software line for the bitcode; the caller releases it once the software LOW is written.
+     *
+     * @param swHighWritten set if the timestamp comes from markNow(), whose software HIGH is already written
+     * @return false if there is nothing to send
+     */
+    bool takeNext(QueuedTimestamp &event, uint8_t &source, int &priorityClass, bool &swHighWritten)
+    {
+        swHighWritten = false;
+        if (config_.hardwareMarker)
+            return popNext(event, source, priorityClass);
+
+        // Leave the line to markNow() while there is nothing to send
+        if (swLine_.load() != SoftwareLine::Marked && !hasRetry_ && queuedTimestamps() == 0)
+            return false;
+        SoftwareLine state = SoftwareLine::Free;
+        while (!swLine_.compare_exchange_weak(state, SoftwareLine::Sender))
+        {
+            if (state == SoftwareLine::Marked)
+            {
+                swHighWritten = true;
+                event = mark_;
+                source = markSource_;
+                priorityClass = int(PriorityClass::Urgent);
+                return true;
+            }
+            state = SoftwareLine::Free; // markNow() is writing the HIGH
+            std::this_thread::yield();
+        }
+        if (popNext(event, source, priorityClass))
+            return true;
+        swLine_.store(SoftwareLine::Free);
+        return false;
+    }
+
+    /**
+     * @return size_t approximate number of queued timestamps, over all sources and priority classes
+     */
+    size_t queuedTimestamps() const
+    {
+        size_t queued = 0;
+        for (const auto &queue : queues_)
+            queued += queue->size();
+        return queued;
+    }
+
+    /**
+     * @brief Wakes the sender if it waits in waitForTimestamps(), after something to send was made visible.
+     *
+     * Taking wakeMutex_ first means the sender either still has to check its wait condition or is already waiting, so
+     * the notification cannot fall between the two and leave it asleep until WAKEUP_TIMEOUT_US.
+     */
+    void wakeSender()
+    {
+        if (!sleeping_.load())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+        }
+        wake_.notify_one();
+    }
+
+    /**
+     * @brief Sleeps until there is something to send (as in takeNext), stop() is called or WAKEUP_TIMEOUT_US elapses.
+     */
+    void waitForTimestamps()
+    {
+        std::unique_lock<std::mutex> lock(wakeMutex_);
+        sleeping_.store(true);
+        wake_.wait_for(lock, std::chrono::microseconds(WAKEUP_TIMEOUT_US), [this] {
+            return !keepSending_ || swLine_.load() == SoftwareLine::Marked || hasRetry_ || queuedTimestamps() > 0;
+        });
+        sleeping_.store(false);
+    }
+
+    /**
+     * @brief Sets the number of samples of the hardware tasks for bitcodes of a new length; between bitcodes only.
+     */
+    void resizeHwTasks(int bitcodeLength)
+    {
+        if (config_.mode == BitcodeMode::DigitalOutput)
+            handleError(DAQmxCfgSampClkTiming(writeHw_, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+                                              bitcodeLength));
+        handleError(DAQmxCfgSampClkTiming(readHw_, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+                                          bitcodeLength + 1));
+    }
+
+    /**
+     * @brief Prints the latency of each priority class that sent timestamps.
+     */
+    void reportLatency(std::ostream &out) const
+    {
+        out << config_.name << " latency from send() to start of bitcode:" << std::endl;
+        for (int c = 0; c < NUM_PRIORITY_CLASSES; c++)
+        {
+            const SendLatencyHistogram &h = latency_[c];
+            if (h.count == 0 && aborts_[c] == 0)
+                continue;
+            out << "  " << PRIORITY_CLASS_NAMES[c] << ": " << h.count << " sent, " << aborts_[c] << " aborted, mean "
+                << h.meanUS() << " us, p50 " << h.percentileUS(0.5) << " us, p99 " << h.percentileUS(0.99)
+                << " us, max " << h.maxUS << " us" << std::endl;
+        }
+    }
+
+    /**
+     * @brief Initializes NIDAQ tasks and sends bitcode pulses as timestamps are queued.
+     */
+    void run()
+    {
+        bool tagged = config_.numSources > 1;
+        FrameFormat format = config_.adaptive ? FrameFormat::adaptive(false, config_.fec, tagged)
+                                              : FrameFormat::timestamp(config_.fec, tagged);
+        int bitcodeLength = format.length();
+        int readArrayLength = bitcodeLength + 1;
+
+        ////////////////////////
+        /* Initialize Channels*/
+        ////////////////////////
+
+        // Create hardware read task and DI channel
+        handleError(DAQmxCreateTask(taskName("readHw").c_str(), &readHw_));
+        handleError(DAQmxCreateDIChan(readHw_, physical(config_.readHwLine).c_str(), "channel0",
+                                      DAQmx_Val_ChanForAllLines));
+        handleError(
+            DAQmxCfgSampClkTiming(readHw_, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps, readArrayLength));
+
+        // Create hardware write task; trigger with readHw start
+        handleError(DAQmxCreateTask(taskName("writeHw").c_str(), &writeHw_));
+        if (config_.hardwareMarker)
+        {
+            // DO channels for the bitcode and the timing marker, in that order
+            std::string lines = physical(config_.writeHwLine) + "," + physical(config_.writeSwLine);
+            handleError(DAQmxCreateDOChan(writeHw_, lines.c_str(), "", DAQmx_Val_ChanPerLine));
+            handleError(DAQmxCfgSampClkTiming(writeHw_, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+                                              bitcodeLength));
+        }
+        else if (config_.mode == BitcodeMode::DigitalOutput)
+        {
+            // DO channel
+            handleError(DAQmxCreateDOChan(writeHw_, physical(config_.writeHwLine).c_str(), "channel1",
+                                          DAQmx_Val_ChanForAllLines));
+            handleError(DAQmxCfgSampClkTiming(writeHw_, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_FiniteSamps,
+                                              bitcodeLength));
+        }
+        else
+        {
+            // Counter output channel; its output terminal (PFI13 for ctr1) must be wired to readHwLine. The initial
+            // delay produces the leading "0" of the bitcode; the extra half sample keeps the pulse edges clear of the
+            // readHw sample clock edges.
+            handleError(DAQmxCreateCOPulseChanTime(writeHw_, physical(config_.counter).c_str(), "counter1",
+                                                   DAQmx_Val_Seconds, DAQmx_Val_Low, DIGIT_PERIOD + 0.5 / SAMPLE_RATE,
+                                                   DIGIT_PERIOD, DIGIT_PERIOD));
+            handleError(DAQmxCfgImplicitTiming(writeHw_, DAQmx_Val_FiniteSamps, MAX_PULSES));
+            counterPulses_ = MAX_PULSES;
+        }
+        std::string startTrigger = "/" + config_.device + "/di/StartTrigger";
+        handleError(DAQmxCfgDigEdgeStartTrig(writeHw_, startTrigger.c_str(), DAQmx_Val_Rising));
+
+        if (!config_.hardwareMarker)
+        {
+            // Create software read task and DI channel
+            handleError(DAQmxCreateTask(taskName("readSw").c_str(), &readSw_));
+            handleError(DAQmxCreateDIChan(readSw_, physical(config_.readSwLine).c_str(), "channel2",
+                                          DAQmx_Val_ChanForAllLines));
+
+            // Create software write task and DO channel
+            handleError(DAQmxCreateTask(taskName("writeSw").c_str(), &writeSw_));
+            handleError(DAQmxCreateDOChan(writeSw_, physical(config_.writeSwLine).c_str(), "channel3",
+                                          DAQmx_Val_ChanForAllLines));
+
+            // Initial software read/write; makes subsequent sw read/writes much faster
+            uInt8 swRead1[1] = {0};
+            uInt8 swWrite1[1] = {0};
+
+            // write LOW;read one sample
+            handleError(DAQmxWriteDigitalLines(writeSw_, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+            handleError(DAQmxReadDigitalLines(readSw_, 1, 1, DAQmx_Val_GroupByChannel, swRead1, sizeof(swRead1), NULL,
+                                              NULL, NULL));
+
+            // The line is LOW and the task warm; markNow() may use it from now on
+            swLine_.store(SoftwareLine::Free);
+        }
+
+        // Optional per-stage perf counters, opened on this thread
+        std::unique_ptr<StageMetrics> metrics;
+        std::ofstream trace;
+        if (config_.perfCounters)
+        {
+            metrics.reset(new StageMetrics(config_.name));
+            if (!config_.perfTracePath.empty())
+            {
+                trace.open(config_.perfTracePath);
+                metrics->setTrace(&trace);
+            }
+        }
+
+        ////////////////////////////////
+        /*Transmit Timestamp as Pulses*/
+        ////////////////////////////////
+
+        while (keepSending_)
+        {
+            // Send every queued timestamp; by priority class, oldest first within a source, interleaved across sources
+            QueuedTimestamp event;
+            uint8_t source;
+            int priorityClass;
+            bool swHighWritten;
+            while (takeNext(event, source, priorityClass, swHighWritten))
+            {
+                // With short codes, every FULL_CODE_INTERVAL-th bitcode is still a full one
+                const SyncMode mode = controller_.mode();
+                if (config_.adaptive)
+                {
+                    bool shortCode = mode.shortCodes && codesSinceFull_ < FULL_CODE_INTERVAL - 1;
+                    codesSinceFull_ = shortCode ? codesSinceFull_ + 1 : 0;
+                    FrameFormat next = FrameFormat::adaptive(shortCode, config_.fec, tagged);
+                    if (next.length() != format.length())
+                        resizeHwTasks(next.length());
+                    format = next;
+                }
+                bool verify = sentCount_++ % uint64_t(mode.verifyEvery) == 0;
+
+                uint64_t tsIn = event.tsIn;
+                uint64_t startUS = getCPUClockTimeUS();
+                Preemption preemption{&urgentQueued_};
+                Preemption *preemptable =
+                    config_.preemption && priorityClass != int(PriorityClass::Urgent) ? &preemption : NULL;
+                BitErrorMonitor *errors = config_.trackBitErrors ? &bitErrors_ : NULL;
+                SendReport report;
+                if (config_.hardwareMarker)
+                    sendTimestampWithHardwareMarker(tsIn, writeHw_, readHw_, format, source, metrics.get(),
+                                                    preemptable, errors, verify, &report);
+                else if (config_.mode == BitcodeMode::DigitalOutput)
+                    sendTimestampAsBitcodePulse(tsIn, writeHw_, readHw_, writeSw_, readSw_, format, source,
+                                                metrics.get(), preemptable, errors, verify, swHighWritten, &report);
+                else
+                    sendTimestampAsCounterPulse(tsIn, writeHw_, readHw_, writeSw_, readSw_, format, source,
+                                                metrics.get(), errors, verify, swHighWritten, &report,
+                                                &counterPulses_);
+                if (!config_.hardwareMarker)
+                    swLine_.store(SoftwareLine::Free);
+
+                // Mark the cut-short bitcode, then send it again once the urgent timestamps are sent
+                if (preemption.aborted)
+                {
+                    sendAbortMarker(writeHw_, readHw_, format.length());
+                    aborts_[priorityClass]++;
+                    hasRetry_ = true;
+                    retry_ = event;
+                    retrySource_ = source;
+                    retryClass_ = priorityClass;
+                    continue;
+                }
+                latency_[priorityClass].add(startUS - event.queuedUS);
+                if (config_.completions)
+                {
+                    uint64_t swHighUS = swHighWritten ? tsIn : report.swHighUS;
+                    SendCompletion completion{tsIn, swHighUS, startUS - event.queuedUS, report.verified, report.ok,
+                                              report.wrongSamples};
+                    if (!completions_[source]->push(completion))
+                        droppedCompletions_.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (config_.adaptive)
+                    controller_.update(queuedTimestamps(), startUS - event.queuedUS, startUS,
+                                       config_.trackBitErrors ? bitErrors_.rollingDigitErrorRate() : 0.0);
+                HOT_PATH_END_SEND();
+            }
+            if (controller_.mode().eventWakeup)
+                waitForTimestamps();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(10)); // Allow time on other threads
+        }
+
+        if (metrics)
+        {
+            metrics->report(std::cout);
+        }
+        if (config_.reportLatency)
+        {
+            reportLatency(std::cout);
+        }
+        if (config_.trackBitErrors)
+        {
+            bitErrors_.report(std::cout, config_.name);
+        }
+
+        handleError(DAQmxClearTask(readHw_));
+        handleError(DAQmxClearTask(writeHw_));
+        if (!config_.hardwareMarker)
+        {
+            // Keep markNow() off the software line for good; end a pending mark, whose bitcode is not sent
+            SoftwareLine state = swLine_.load();
+            while (state == SoftwareLine::Marking || !swLine_.compare_exchange_weak(state, SoftwareLine::Sender))
+            {
+                std::this_thread::yield();
+                state = swLine_.load();
+            }
+            if (state == SoftwareLine::Marked)
+            {
+                uInt8 swWrite1[1] = {0};
+                handleError(
+                    DAQmxWriteDigitalLines(writeSw_, 1, true, 1, DAQmx_Val_GroupByChannel, swWrite1, NULL, NULL));
+            }
+            handleError(DAQmxClearTask(readSw_));
+            handleError(DAQmxClearTask(writeSw_));
+        }
+    }
+
+    // Written by the caller of start()/stop() and by producers
+    BitcodeSenderConfig config_;
+    std::vector<std::unique_ptr<EventQueue<QueuedTimestamp>>> queues_;     // One per priority class and source
+    std::atomic<int> urgentQueued_{0};                                     // Urgent timestamps in the queues
+    std::vector<std::unique_ptr<EventQueue<SendCompletion>>> completions_; // One per source, with config.completions
+    std::atomic<uint64_t> droppedCompletions_{0};
+    std::atomic<bool> keepSending_{false};
+    std::thread thread_;
+    std::mutex wakeMutex_;
+    std::condition_variable wake_;       // Notified by send() and markNow() while the sender waits
+    std::atomic<bool> sleeping_{false}; // The sender waits on wake_
+    std::atomic<SoftwareLine> swLine_{SoftwareLine::Sender};
+    QueuedTimestamp mark_ = {}; // Written by markNow() before swLine_ becomes Marked
+    uint8_t markSource_ = 0;
+
+    // Used by the sender thread only; writeSw_ also by markNow() while it holds swLine_
+    alignas(CACHE_LINE_SIZE) TaskHandle readHw_ = NULL;
+    TaskHandle writeHw_ = NULL;
+    TaskHandle readSw_ = NULL;
+    TaskHandle writeSw_ = NULL;
+    int counterPulses_ = MAX_PULSES;            // Pulses writeHw_ is configured for in BitcodeMode::CounterOutput
+    int nextSource_[NUM_PRIORITY_CLASSES] = {}; // First source to try on the next RoundRobin pop, per class
+    bool hasRetry_ = false;                      // An aborted timestamp waits to be sent again
+    QueuedTimestamp retry_ = {};
+    uint8_t retrySource_ = 0;
+    int retryClass_ = 0;
+    SendLatencyHistogram latency_[NUM_PRIORITY_CLASSES];
+    uint64_t aborts_[NUM_PRIORITY_CLASSES] = {};
+    BitErrorMonitor bitErrors_;
+    SyncModeController controller_;
+    int codesSinceFull_ = 0; // Short codes sent since the last full one
+    uint64_t sentCount_ = 0; // Bitcodes taken from the queues; selects the ones verified
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstdint>
+
+constexpr int FEC_PARITY_BITS = 7;                   // Hamming parity bits; 64 data bits occupy positions 3..71 of a Hamming(127,120) code
+constexpr int FEC_EXTRA_BITS = 8;                    // Data bits beyond the 64-bit word (e.g. a source tag)
+constexpr int FEC_DIGITS = FEC_PARITY_BITS + 1;      // Hamming parity bits + overall parity bit (single error correction, double error detection)
+constexpr int FEC_OVERALL_PARITY_BIT = 1 << FEC_PARITY_BITS; // Position of the overall parity bit in the check byte
+
+/**
+ * @brief Lookup tables for the extended Hamming(72,64) code, optionally with FEC_EXTRA_BITS more data bits.
+ *
+ * Data bit i is placed at the i-th position of the Hamming code that is not a power of two, so its parity contribution
+ * is simply that position. Encoding XORs the contributions of the data bytes; decoding looks up the outcome of a
+ * syndrome (the position of a flipped bit) and the overall parity, so it needs no branches. Extra data bits that are
+ * zero contribute nothing, so codes without them are unchanged.
+ */
+struct HammingTables
+{
+    uint8_t parity[9][256];    // Parity contribution of each value of each data byte; byte 8 holds the extra bits
+    int8_t syndromeToBit[128]; // Data bit index (64 and up: extra bits) for each syndrome; -1 if not a data position
+    int8_t fixBit[256];        // Data bit to flip for each (overall parity error << 7 | syndrome); -1 if none
+    int8_t corrected[256];     // Corrected bits (0 or 1), or -1 if uncorrectable, for the same index
+};
+
+/**
+ * @brief Builds the Hamming lookup tables.
+ *
+ * @return HammingTables
+ */
+inline HammingTables buildHammingTables()
+{
+    HammingTables tables = {};
+
+    uint8_t position[64 + FEC_EXTRA_BITS];
+    for (int s = 0; s < 128; s++)
+    {
+        tables.syndromeToBit[s] = -1;
+    }
+    int p = 1;
+    for (int i = 0; i < 64 + FEC_EXTRA_BITS; i++)
+    {
+        // Skip positions reserved for parity bits (powers of two)
+        do
+        {
+            p++;
+        } while ((p & (p - 1)) == 0);
+        position[i] = uint8_t(p);
+        tables.syndromeToBit[p] = int8_t(i);
+    }
+
+    for (int byte = 0; byte < 9; byte++)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            uint8_t parity = 0;
+            for (int b = 0; b < 8; b++)
+            {
+                if (value & (1 << b))
+                {
+                    parity ^= position[byte * 8 + b];
+                }
+            }
+            tables.parity[byte][value] = parity;
+        }
+    }
+
+    for (int index = 0; index < 256; index++)
+    {
+        int syndrome = index & (FEC_OVERALL_PARITY_BIT - 1);
+        bool overallError = (index & FEC_OVERALL_PARITY_BIT) != 0;
+        int8_t fixBit = -1;
+        int8_t corrected;
+        if (syndrome == 0)
+            corrected = overallError ? 1 : 0; // Either no error, or the overall parity bit itself flipped
+        else if (!overallError)
+            corrected = -1; // Non-zero syndrome with correct overall parity: two bits flipped
+        else if ((syndrome & (syndrome - 1)) == 0)
+            corrected = 1; // A Hamming parity bit flipped; data is intact
+        else if (tables.syndromeToBit[syndrome] < 0)
+            corrected = -1; // Syndrome points outside the shortened code; more than two bits flipped
+        else
+        {
+            fixBit = tables.syndromeToBit[syndrome];
+            corrected = 1;
+        }
+        tables.fixBit[index] = fixBit;
+        tables.corrected[index] = corrected;
+    }
+    return tables;
+}
+
+/**
+ * @brief Gets the Hamming lookup tables, building them on first use.
+ *
+ * @return const HammingTables&
+ */
+inline const HammingTables &hammingTables()
+{
+    static const HammingTables tables = buildHammingTables();
+    return tables;
+}
+
+/**
+ * @brief Computes the 7 Hamming parity bits of a 64-bit data word and its extra data bits.
+ *
+ * @param data data word
+ * @param extra extra data bits
+ * @return uint8_t parity bits
+ */
+inline uint8_t computeHammingParity(uint64_t data, uint8_t extra = 0)
+{
+    const HammingTables &tables = hammingTables();
+    uint8_t parity = tables.parity[8][extra];
+    for (int byte = 0; byte < 8; byte++)
+    {
+        parity ^= tables.parity[byte][(data >> (8 * byte)) & 0xFF];
+    }
+    return parity;
+}
+
+/**
+ * @brief Computes the check byte (7 Hamming parity bits + overall parity bit) of a 64-bit data word.
+ *
+ * @param data data word
+ * @param extra extra data bits, e.g. a source tag
+ * @return uint8_t check byte; bits 0-6 are the Hamming parity bits and bit 7 is the overall parity bit
+ */
+inline uint8_t encodeHammingCheck(uint64_t data, uint8_t extra = 0)
+{
+    uint8_t parity = computeHammingParity(data, extra);
+    int overall = (__builtin_popcountll(data) + __builtin_popcount(extra) + __builtin_popcount(parity)) & 1;
+    return uint8_t(parity | (overall << FEC_PARITY_BITS));
+}
+
+/**
+ * @brief Corrects a 64-bit data word and its extra data bits using their check byte.
+ *
+ * Single-bit errors anywhere in the codeword are corrected; double-bit errors are detected.
+ *
+ * @param data data word; corrected in place
+ * @param extra extra data bits; corrected in place
+ * @param check check byte as received
+ * @return int number of corrected bits (0 or 1), or -1 if the error is uncorrectable
+ */
+inline int decodeHammingCheck(uint64_t &data, uint8_t &extra, uint8_t check)
+{
+    const HammingTables &tables = hammingTables();
+    int syndrome = computeHammingParity(data, extra) ^ (check & (FEC_OVERALL_PARITY_BIT - 1));
+    int overallError = (__builtin_popcountll(data) + __builtin_popcount(extra) + __builtin_popcount(check)) & 1;
+    int index = syndrome | (overallError << FEC_PARITY_BITS);
+
+    int fixBit = tables.fixBit[index];
+    data ^= uint64_t(fixBit >= 0 && fixBit < 64) << (fixBit & 63);
+    extra ^= uint8_t((fixBit >= 64) << (fixBit & 7));
+    return tables.corrected[index];
+}
+
+/**
+ * @brief Corrects a 64-bit data word using its check byte.
+ *
+ * @param data data word; corrected in place
+ * @param check check byte as received
+ * @return int number of corrected bits (0 or 1), or -1 if the error is uncorrectable
+ */
+inline int decodeHammingCheck(uint64_t &data, uint8_t check)
+{
+    uint8_t extra = 0;
+    int corrected = decodeHammingCheck(data, extra, check);
+    return extra != 0 ? -1 : corrected; // A "correction" of an extra bit means more than one bit flipped
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+/**
+ * Bitcode format shared by the sender and the offline decoders; independent of NI-DAQmx.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bitcode_fec.cpp"
+
+constexpr int DIGIT_SAMPLE_HZ = 1000;                            // Hz; apparent sampling rate of digits from Intan
+constexpr int DIGIT_REPEATS = 40;                                // Number of repeated samples for each digit
+constexpr int NUM_DIGITS = 68;                                   // Number of digits in binary representation of timestamp (64 for timestamp + 4 for start/end digits)
+constexpr int BITCODE_LENGTH = NUM_DIGITS * DIGIT_REPEATS;       // 64 digits for timestamp + 4 digits for start/end of bitcode, with DIGIT_REPEATS samples for each digit
+constexpr int READ_ARRAY_LENGTH = BITCODE_LENGTH + 1;            // Read 1 sample more than write
+constexpr int NUM_DIGITS_FEC = NUM_DIGITS + FEC_DIGITS;          // Number of digits with forward error correction (64 for timestamp + 8 check digits + 4 for start/end digits)
+constexpr int BITCODE_LENGTH_FEC = NUM_DIGITS_FEC * DIGIT_REPEATS; // Bitcode length with forward error correction
+constexpr int READ_ARRAY_LENGTH_FEC = BITCODE_LENGTH_FEC + 1;    // Read 1 sample more than write
+constexpr int TAG_BITS = 4;                                      // Bits of the source tag of a tagged bitcode
+constexpr int NUM_SOURCES = 1 << TAG_BITS;                       // Producers that can share one tagged sync line
+constexpr int SHORT_TIMESTAMP_BITS = 32;                         // Low timestamp bits sent by short bitcodes
+constexpr int MAX_NUM_DIGITS = NUM_DIGITS_FEC + TAG_BITS + 1;    // Digits of the longest bitcode (flag, tag, fec)
+constexpr int MAX_BITCODE_LENGTH = MAX_NUM_DIGITS * DIGIT_REPEATS; // Length of the longest bitcode
+constexpr int MAX_READ_ARRAY_LENGTH = MAX_BITCODE_LENGTH + 1;    // Read 1 sample more than write
+
+// Dual-rate sync: short sequence-number frames at a high rate on one line, full timestamp frames at a low rate on
+// another, both generated from the same sample clock (see dual_rate_sync.cpp)
+constexpr int SEQUENCE_BITS = 16;                               // Bits of the sequence number; wraps every 65536 frames
+constexpr int SEQUENCE_DIGIT_REPEATS = 4;                       // Samples per digit of a sequence frame (100 us)
+constexpr int SEQUENCE_PERIOD = 400;                            // Samples from one sequence frame to the next (10 ms)
+constexpr int SEQUENCE_FRAMES_PER_TIMESTAMP = 100;              // Sequence frames per timestamp frame (1 s)
+constexpr int TIMESTAMP_PERIOD = SEQUENCE_PERIOD * SEQUENCE_FRAMES_PER_TIMESTAMP; // Samples between timestamp frames
+
+// Abort marker: sent after a bitcode is cut short, so decoders can skip the partial frame. Its two pulses are half a
+// digit long, which no complete frame contains, since all of its runs last whole digits.
+constexpr int ABORT_PULSE_SAMPLES = DIGIT_REPEATS / 2;          // Length of each HIGH pulse and of the gap between them
+constexpr int ABORT_MARKER_LENGTH = 3 * DIGIT_REPEATS + 3 * ABORT_PULSE_SAMPLES; // LOW digit, pulses, two LOW digits
+
+/**
+ * @brief Layout of a frame: "01", optionally a length flag digit, tagBits digits of the source tag, dataBits digits of
+ * data, optionally the FEC_DIGITS Hamming check digits, then "10". Fields are sent most significant digit first, and
+ * each digit lasts digitRepeats samples. The check digits protect the tag as well as the data.
+ *
+ * The length flag lets full and short frames share a line: it is 1 for frames with fewer than 64 data bits, so a
+ * decoder can tell the length of a frame from its third digit (see decodeAdaptiveFrames).
+ */
+struct FrameFormat
+{
+    int dataBits = 64;
+    int digitRepeats = DIGIT_REPEATS;
+    bool fec = false;
+    int tagBits = 0;
+    bool lengthFlag = false;
+
+    int numDigits() const { return lengthFlag + tagBits + dataBits + 4 + (fec ? FEC_DIGITS : 0); }
+    int length() const { return numDigits() * digitRepeats; }
+    uint64_t dataMask() const { return dataBits < 64 ? (uint64_t(1) << dataBits) - 1 : ~uint64_t(0); }
+
+    /**
+     * @brief Format of the 64-bit timestamp bitcode sent by the BitcodeSender.
+     *
+     * @param fec whether to append the Hamming check digits
+     * @param tagged whether the timestamp is preceded by a TAG_BITS source tag
+     */
+    static FrameFormat timestamp(bool fec = false, bool tagged = false)
+    {
+        return FrameFormat{64, DIGIT_REPEATS, fec, tagged ? TAG_BITS : 0};
+    }
+
+    /**
+     * @brief Format of the short, fast frames of the dual-rate sequence line.
+     */
+    static FrameFormat sequence() { return FrameFormat{SEQUENCE_BITS, SEQUENCE_DIGIT_REPEATS, false}; }
+
+    /**
+     * @brief Format of the timestamp bitcodes of a sender that switches between full and short codes.
+     *
+     * @param shortCode whether to send only the SHORT_TIMESTAMP_BITS low bits of the timestamp
+     * @param fec whether to append the Hamming check digits
+     * @param tagged whether the timestamp is preceded by a TAG_BITS source tag
+     */
+    static FrameFormat adaptive(bool shortCode, bool fec = false, bool tagged = false)
+    {
+        return FrameFormat{shortCode ? SHORT_TIMESTAMP_BITS : 64, DIGIT_REPEATS, fec, tagged ? TAG_BITS : 0, true};
+    }
+};
+
+static_assert((SEQUENCE_BITS + 4) * SEQUENCE_DIGIT_REPEATS < SEQUENCE_PERIOD, "Sequence frames must not overlap");
+static_assert(BITCODE_LENGTH_FEC < TIMESTAMP_PERIOD, "Timestamp frames must not overlap");
+static_assert(TAG_BITS <= FEC_EXTRA_BITS, "The Hamming code must cover the tag");
+
+/**
+ * @brief Converts an integer to the digits of a frame.
+ *
+ * The first two digits are "01" and the last two digits are "10", which signify the start/end of a bitcode signal. The
+ * middle digits are the length flag (if any), the source tag, then the binary representation of the integer, each
+ * padded with leading zeros to their number of digits. With forward error correction, the FEC_DIGITS digits of the
+ * Hamming check byte (most significant first) follow the integer.
+ *
+ * @param n integer to convert; bits above format.dataBits are dropped
+ * @param format frame layout
+ * @param digits array of length format.numDigits() to write digits to
+ * @param tag source tag; bits above format.tagBits are dropped
+ * @return int number of digits written
+ */
+int convertIntToDigits(uint64_t n, const FrameFormat &format, uint8_t *digits, uint8_t tag = 0)
+{
+    n &= format.dataMask();
+    tag &= uint8_t((1 << format.tagBits) - 1);
+
+    int numDigits = 0;
+    digits[numDigits++] = 0;
+    digits[numDigits++] = 1;
+    if (format.lengthFlag)
+    {
+        digits[numDigits++] = format.dataBits < 64;
+    }
+    for (int i = format.tagBits - 1; i >= 0; i--)
+    {
+        digits[numDigits++] = (tag >> i) & 1;
+    }
+    for (int i = format.dataBits - 1; i >= 0; i--)
+    {
+        digits[numDigits++] = (n >> i) & 1;
+    }
+    if (format.fec)
+    {
+        uint8_t check = encodeHammingCheck(n, tag);
+        for (int i = FEC_DIGITS - 1; i >= 0; i--)
+        {
+            digits[numDigits++] = (check >> i) & 1;
+        }
+    }
+    digits[numDigits++] = 1;
+    digits[numDigits++] = 0;
+    return numDigits;
+}
+
+/**
+ * @brief Converts an integer to the digits of a timestamp bitcode.
+ *
+ * @param n integer to convert
+ * @param fec whether to append the Hamming check digits
+ * @param digits array of length NUM_DIGITS (NUM_DIGITS_FEC with fec) to write digits to
+ * @return int number of digits written
+ */
+int convertIntToDigits(uint64_t n, bool fec, uint8_t *digits)
+{
+    return convertIntToDigits(n, FrameFormat::timestamp(fec), digits);
+}
+
+/**
+ * @brief Writes the samples of the abort marker: one LOW digit, a HIGH pulse, a LOW gap, a HIGH pulse, then two LOW
+ * digits before the next frame may start.
+ *
+ * @param samples array of length ABORT_MARKER_LENGTH
+ */
+void writeAbortMarker(uint8_t *samples)
+{
+    int i = 0;
+    for (int end = DIGIT_REPEATS; i < end; i++)
+        samples[i] = 0;
+    for (int pulse = 0; pulse < 2; pulse++)
+    {
+        for (int end = i + ABORT_PULSE_SAMPLES; i < end; i++)
+            samples[i] = 1;
+        for (int end = i + ABORT_PULSE_SAMPLES; i < end; i++)
+            samples[i] = 0;
+    }
+    for (; i < ABORT_MARKER_LENGTH; i++)
+        samples[i] = 0;
+}
+
+/**
+ * @brief Corrects the data and tag of a received frame using its check digits.
+ *
+ * @param format frame layout; must have fec
+ * @param n data; corrected in place
+ * @param tag tag; corrected in place
+ * @param check check byte as received
+ * @return int number of corrected digits (0 or 1), or -1 if the error is uncorrectable
+ */
+inline int correctFrame(const FrameFormat &format, uint64_t &n, uint8_t &tag, uint8_t check)
+{
+    int corrected = decodeHammingCheck(n, tag, check);
+
+    // A "correction" of a bit outside the data and tag fields means more than one digit flipped
+    bool outside = (format.dataBits < 64 && (n >> (format.dataBits & 63)) != 0) || (tag >> format.tagBits) != 0;
+    return outside ? -1 : corrected;
+}
+
+/**
+ * @brief Converts a bitcode array to an integer.
+ *
+ * With forward error correction, a single flipped digit anywhere in the tag, timestamp or check digits is corrected.
+ *
+ * @param readArray array of bits read from read_hw task, of length format.length() + 1
+ * @param format frame layout; digits must last DIGIT_REPEATS samples
+ * @param tag if not NULL, set to the source tag
+ * @param correctedBits if not NULL, set to the number of corrected digits, or -1 if the error was uncorrectable
+ * @return uint64_t
+ */
+uint64_t convertReadArrayToInt(const uint8_t *readArray, const FrameFormat &format, uint8_t *tag = NULL,
+                               int *correctedBits = NULL)
+{
+    // The read task trails the write task by 1 sample, so digit k starts at readArray[1 + k * DIGIT_REPEATS]. Each
+    // digit is read at its middle, like the offline decoder does. The first two digits "01" and the last two digits
+    // "10" signify the start/end of the bitcode.
+    const uint8_t *digits = readArray + 1 + DIGIT_REPEATS / 2;
+    int k = 2 + format.lengthFlag;
+    uint8_t t = 0;
+    for (int end = k + format.tagBits; k < end; k++)
+    {
+        t = uint8_t((t << 1) | (digits[k * DIGIT_REPEATS] != 0));
+    }
+    uint64_t n = 0;
+    for (int end = k + format.dataBits; k < end; k++)
+    {
+        n = (n << 1) | (digits[k * DIGIT_REPEATS] != 0);
+    }
+
+    // Correct the tag and n using the check digits that follow them
+    if (format.fec)
+    {
+        uint8_t check = 0;
+        for (int end = k + FEC_DIGITS; k < end; k++)
+        {
+            check = uint8_t((check << 1) | (digits[k * DIGIT_REPEATS] != 0));
+        }
+        int corrected = correctFrame(format, n, t, check);
+        if (correctedBits != NULL)
+        {
+            *correctedBits = corrected;
+        }
+    }
+
+    if (tag != NULL)
+    {
+        *tag = t;
+    }
+    return n;
+}
+
+/**
+ * @brief Converts a timestamp bitcode array to an integer.
+ *
+ * @param readArray array of bits read from read_hw task. Should have length BITCODE_LENGTH+1 (BITCODE_LENGTH_FEC+1
+ * with fec).
+ * @param fec whether the bitcode carries Hamming check digits
+ * @param correctedBits if not NULL, set to the number of corrected digits, or -1 if the error was uncorrectable
+ * @return uint64_t
+ */
+uint64_t convertReadArrayToInt(const uint8_t *readArray, bool fec = false, int *correctedBits = NULL)
+{
+    return convertReadArrayToInt(readArray, FrameFormat::timestamp(fec), NULL, correctedBits);
+}
@@ -0,0 +1,341 @@
+/**
+ * This file decodes every bitcode in a recording of the sync line, offline and without a NI-DAQ board.
+ *
+ * The recording is a raw file sampled at SAMPLE_RATE like the readback of the sender, with either one byte per sample
+ * (non-zero is HIGH), or with "port8", "port16" or "port32" a packed port read of 8, 16 or 32 lines per sample, which
+ * is split into bit planes and decoded line by line. Frames are printed as CSV lines
+ * "line,sample,timestamp,flags,tag" (see FrameFlags); with "tagged", frames carry the source tag of a BitcodeSender
+ * with several sources, and the summary on stderr also counts the clean frames of each source. With "preempt", frames
+ * cut short by the abort marker of a preempting sender are skipped and counted. With "adaptive", frames of a sender
+ * with config.adaptive are read as full or short codes by their length flag, and short codes are restored to full
+ * timestamps; give both options for a sender with config.adaptive and config.preemption.
+ *
+ * Recordings of acquisition systems are read with the reader for their format instead (see digital_line_reader.cpp):
+ * an Intan .rhd file or digitalin.dat, the continuous.dat of an Open Ephys stream, or a SpikeGLX .bin with its .meta.
+ * Their recorded digital lines are decoded line by line, at the sample rate of the recording.
+ *
+ * A raw recording of one analog channel ("analog16" for int16 samples, "analogu16" for offset binary uint16 samples
+ * such as Intan board ADC files, "analogf32" for float samples) is converted to a line with hysteresis thresholds
+ * first (see analog_threshold.cpp). Its LOW and HIGH levels are estimated unless given with "levels=LOW:HIGH".
+ * "rate=HZ" sets the sample rate of raw recordings.
+ *
+ * Usage: ./decode_bitcode recording.bin|recording.rhd|digitalin.dat|continuous.dat|spikeglx.bin [fec] [tagged]
+ *        [preempt] [adaptive] [port8|port16|port32|analog16|analogu16|analogf32] [levels=LOW:HIGH] [rate=HZ]
+ *        > frames.csv
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "analog_threshold.cpp"
+#include "batch_decoder.cpp"
+#include "digital_line_reader.cpp"
+
+/**
+ * @brief Decodes the frames of one line and prints them, either from the whole line at once or chunk by chunk.
+ *
+ * Chunks are appended to the samples left over from the previous chunk: those from one digit before the next frame
+ * search on, which cover any frame that may reach past the previous chunk. The search position and the reference
+ * frame of adaptive decoding are carried along in a FrameSearch.
+ */
+class LineDecoder
+{
+public:
+    /**
+     * @param sampleRate sample rate of the recording (Hz); a digit lasts sampleRate / DIGIT_SAMPLE_HZ samples
+     */
+    LineDecoder(int line, double sampleRate, bool fec, bool tagged, bool preempt, bool adaptive)
+        : line_(line), sampleRate_(sampleRate), fec_(fec), tagged_(tagged), preempt_(preempt), adaptive_(adaptive),
+          digitLength_(size_t(std::lround(sampleRate / DIGIT_SAMPLE_HZ))), sources_(NUM_SOURCES, 0)
+    {
+    }
+
+    int line() const { return line_; }
+    size_t frames() const { return frames_; }
+    size_t flagged() const { return flagged_; }
+
+    /**
+     * @brief Decodes all frames of a whole line.
+     */
+    template <typename Samples>
+    void decode(const Samples &samples, size_t numSamples)
+    {
+        decode(samples, numSamples, 0, NULL);
+    }
+
+    /**
+     * @brief Decodes the frames of the next chunk of a line; chunks but the last hold a multiple of 64 samples.
+     *
+     * @param last whether the chunk ends the line; frames that may reach past a chunk are decoded with the next one
+     */
+    void decodeChunk(const BitPlane &chunk, bool last)
+    {
+        // Drop whole words before the samples still needed, so the chunk is appended word by word
+        size_t keepFrom = search_.next > digitLength_ ? search_.next - digitLength_ : 0;
+        size_t drop = std::min(keepFrom / 64, window_.words.size());
+        window_.words.erase(window_.words.begin(), window_.words.begin() + drop);
+        window_.numSamples -= 64 * drop;
+        windowStart_ += 64 * drop;
+        search_.shift(64 * drop);
+
+        window_.words.insert(window_.words.end(), chunk.words.begin(), chunk.words.end());
+        window_.numSamples += chunk.numSamples;
+        search_.last = last;
+        decode(window_, window_.numSamples, windowStart_, &search_);
+    }
+
+    /**
+     * @brief Prints the number of aborted frames, and with tagged, the clean frames of each source.
+     */
+    void printSummary() const
+    {
+        if (aborted_ != 0)
+            std::cerr << "Line " << line_ << ": " << aborted_ << " aborted frames" << std::endl;
+        for (size_t tag = 0; tag < sources_.size(); tag++)
+        {
+            if (sources_[tag] != 0)
+                std::cerr << "Line " << line_ << ", source " << tag << ": " << sources_[tag] << " frames" << std::endl;
+        }
+    }
+
+private:
+    /**
+     * @param firstSample sample of the line at samples[0]
+     * @param search if not NULL, the search continues from it (see FrameSearch)
+     */
+    template <typename Samples>
+    void decode(const Samples &samples, size_t numSamples, uint64_t firstSample, FrameSearch *search)
+    {
+        std::vector<uint64_t> frameStarts;
+        std::vector<uint64_t> aborted;
+        DecodedFrames frames;
+        if (adaptive_)
+        {
+            frames = decodeAdaptiveFrames(samples, numSamples, fec_, tagged_, sampleRate_, frameStarts,
+                                          preempt_ ? &aborted : NULL, search);
+        }
+        else
+        {
+            FrameFormat format = FrameFormat::timestamp(fec_, tagged_);
+            format.digitRepeats = int(digitLength_);
+            frameStarts = findFrameStarts(samples, numSamples, format, preempt_ ? &aborted : NULL, search);
+            frames = decodeFrames(samples, numSamples, frameStarts.data(), frameStarts.size(), format);
+        }
+        aborted_ += aborted.size();
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            std::cout << line_ << "," << firstSample + frameStarts[i] << "," << frames.timestamps[i] << ","
+                      << int(frames.flags[i]) << "," << int(frames.tags[i]) << "\n";
+            flagged_ += frames.flags[i] != 0;
+        }
+        frames_ += frames.size();
+        if (tagged_)
+        {
+            std::vector<std::vector<size_t>> sources = demultiplexByTag(frames);
+            for (size_t tag = 0; tag < sources.size(); tag++)
+                sources_[tag] += sources[tag].size();
+        }
+    }
+
+    int line_;
+    double sampleRate_;
+    bool fec_;
+    bool tagged_;
+    bool preempt_;
+    bool adaptive_;
+    size_t digitLength_;
+
+    size_t frames_ = 0;
+    size_t flagged_ = 0;
+    size_t aborted_ = 0;
+    std::vector<size_t> sources_; // Clean frames by source tag
+
+    // Samples kept for the next chunk
+    BitPlane window_;
+    uint64_t windowStart_ = 0; // Sample of the line at window_[0]
+    FrameSearch search_;
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " recording.bin|recording.rhd|digitalin.dat|continuous.dat|spikeglx.bin [fec] [tagged]"
+                  << " [preempt] [adaptive] [port8|port16|port32|analog16|analogu16|analogf32] [levels=LOW:HIGH]"
+                  << " [rate=HZ]" << std::endl;
+        return 1;
+    }
+    bool fec = false;
+    bool tagged = false;
+    bool preempt = false;
+    bool adaptive = false;
+    int portBytes = 0; // 0: one byte per sample of a single line
+    bool analog = false;
+    AnalogSampleType analogType = AnalogSampleType::Int16;
+    AnalogLevels levels; // Estimated unless given
+    // Raw recordings are sampled like the readback of the sender, unless told otherwise
+    double sampleRate = DIGIT_SAMPLE_HZ * DIGIT_REPEATS;
+    for (int i = 2; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "fec") == 0)
+            fec = true;
+        else if (std::strcmp(argv[i], "tagged") == 0)
+            tagged = true;
+        else if (std::strcmp(argv[i], "preempt") == 0)
+            preempt = true;
+        else if (std::strcmp(argv[i], "adaptive") == 0)
+            adaptive = true;
+        else if (std::strcmp(argv[i], "port8") == 0)
+            portBytes = 1;
+        else if (std::strcmp(argv[i], "port16") == 0)
+            portBytes = 2;
+        else if (std::strcmp(argv[i], "port32") == 0)
+            portBytes = 4;
+        else if (std::strcmp(argv[i], "analog16") == 0)
+        {
+            analog = true;
+            analogType = AnalogSampleType::Int16;
+        }
+        else if (std::strcmp(argv[i], "analogu16") == 0)
+        {
+            analog = true;
+            analogType = AnalogSampleType::UInt16;
+        }
+        else if (std::strcmp(argv[i], "analogf32") == 0)
+        {
+            analog = true;
+            analogType = AnalogSampleType::Float32;
+        }
+        else if (std::strncmp(argv[i], "levels=", 7) == 0)
+            std::sscanf(argv[i] + 7, "%lf:%lf", &levels.low, &levels.high);
+        else if (std::strncmp(argv[i], "rate=", 5) == 0)
+            sampleRate = std::atof(argv[i] + 5);
+    }
+
+    std::string error;
+    std::unique_ptr<DigitalLineReader> reader = openDigitalLineReader(argv[1], error);
+    if (!error.empty())
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (reader)
+    {
+        std::cerr << reader->formatName() << ", " << reader->sampleRate() << " Hz, " << reader->numSamples()
+                  << " samples from sample number " << reader->firstSampleNumber() << ", line mask 0x" << std::hex
+                  << reader->lineMask() << std::dec << std::endl;
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<LineDecoder> decoders;
+        for (int line = 0; line < READER_MAX_LINES; line++)
+        {
+            if ((reader->lineMask() >> line) & 1)
+                decoders.emplace_back(line, reader->sampleRate(), fec, tagged, preempt, adaptive);
+        }
+
+        // Frames are printed chunk by chunk; only the lines recorded are transposed
+        size_t numSamples = reader->numSamples();
+        std::vector<uint16_t> words(READER_CHUNK_SAMPLES);
+        for (size_t first = 0; first < numSamples; first += READER_CHUNK_SAMPLES)
+        {
+            size_t count = std::min(READER_CHUNK_SAMPLES, numSamples - first);
+            std::vector<BitPlane> planes = readBitPlaneChunk(*reader, first, count, words.data());
+            for (LineDecoder &decoder : decoders)
+                decoder.decodeChunk(planes[decoder.line()], first + count == numSamples);
+        }
+
+        size_t numFrames = 0;
+        size_t flagged = 0;
+        for (const LineDecoder &decoder : decoders)
+        {
+            decoder.printSummary();
+            numFrames += decoder.frames();
+            flagged += decoder.flagged();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "Decoded " << numFrames << " frames (" << flagged << " flagged) in " << elapsed.count() * 1e3
+                  << " ms" << std::endl;
+        return 0;
+    }
+
+    if (analog)
+    {
+        MappedFile file;
+        if (!file.open(argv[1]))
+        {
+            std::cerr << file.error() << std::endl;
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        BitPlane plane;
+        if (!analogToBitPlane(file.data(), file.size(), analogType, levels, plane))
+        {
+            std::cerr << "Cannot find the LOW and HIGH levels of " << argv[1] << "; give them with levels=LOW:HIGH"
+                      << std::endl;
+            return 1;
+        }
+        std::chrono::duration<double> thresholded = std::chrono::steady_clock::now() - start;
+        std::cerr << "Levels " << levels.low << " to " << levels.high << ", " << plane.numSamples
+                  << " samples thresholded in " << thresholded.count() * 1e3 << " ms" << std::endl;
+
+        LineDecoder decoder(0, sampleRate, fec, tagged, preempt, adaptive);
+        decoder.decode(plane, plane.numSamples);
+        decoder.printSummary();
+        size_t numFrames = decoder.frames();
+        size_t flagged = decoder.flagged();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "Decoded " << numFrames << " frames (" << flagged << " flagged) in " << elapsed.count() * 1e3
+                  << " ms" << std::endl;
+        return 0;
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> samples((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    auto start = std::chrono::steady_clock::now();
+    size_t numFrames = 0;
+    size_t flagged = 0;
+    if (portBytes == 0)
+    {
+        LineDecoder decoder(0, sampleRate, fec, tagged, preempt, adaptive);
+        decoder.decode(samples.data(), samples.size());
+        decoder.printSummary();
+        numFrames = decoder.frames();
+        flagged = decoder.flagged();
+    }
+    else
+    {
+        size_t numSamples = samples.size() / portBytes;
+        std::vector<BitPlane> planes = transposeToBitPlanes(samples.data(), numSamples, portBytes, 8 * portBytes);
+        for (size_t line = 0; line < planes.size(); line++)
+        {
+            LineDecoder decoder(int(line), sampleRate, fec, tagged, preempt, adaptive);
+            decoder.decode(planes[line], numSamples);
+            decoder.printSummary();
+            numFrames += decoder.frames();
+            flagged += decoder.flagged();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "Decoded " << numFrames << " frames (" << flagged << " flagged) in " << elapsed.count() * 1e3 << " ms"
+              << std::endl;
+    return 0;
+}
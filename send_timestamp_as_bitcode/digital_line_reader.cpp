@@ -0,0 +1,532 @@
+#pragma once
+
+/**
+ * Readers for the digital sync lines of recordings from different acquisition systems, behind one interface.
+ *
+ * Every reader memory-maps its files and returns the lines in chunks of packed 16-bit words, where bit n of word i is
+ * line n at sample i, however the format stores them. readBitPlaneChunk turns each chunk into one bit plane per
+ * recorded line for the batch decoder, so every format shares the same decode path, and a recording is never held in
+ * memory as a whole. Supported formats:
+ * - Intan traditional .rhd files (see intan_rhd.cpp);
+ * - Intan one-file-per-signal-type recordings: digitalin.dat holds one word per sample; the sample rate comes from the
+ *   info.rhd next to it;
+ * - Open Ephys binary format (0.6 and later), given the continuous.dat of a stream: the TTL events of the stream
+ *   (events/<stream>/TTL/sample_numbers.npy and states.npy) are replayed onto its samples; Open Ephys line n + 1 is
+ *   line n here;
+ * - SpikeGLX .bin files: the sync channel (the last saved channel) of the interleaved int16 samples, with the channel
+ *   count, sample rate and recorded lines from the .meta file next to it.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bit_planes.cpp"
+#include "intan_rhd.cpp"
+#include "mapped_file.cpp"
+
+constexpr size_t READER_CHUNK_SAMPLES = 1 << 16; // Samples per chunk; a multiple of 64, so chunk planes concatenate
+constexpr int READER_MAX_LINES = 16;             // Lines of a packed word
+constexpr size_t SPIKEGLX_PREFETCH_SAMPLES = 16; // Samples prefetched ahead in the interleaved SpikeGLX data
+constexpr int SPIKEGLX_IMEC_SYNC_BIT = 6;        // Bit of the imec SY word with the sync input; bits 0-5 are errors
+
+/**
+ * @brief Recording of up to READER_MAX_LINES digital lines, read in chunks of packed words.
+ */
+class DigitalLineReader
+{
+public:
+    virtual ~DigitalLineReader() = default;
+
+    virtual const char *formatName() const = 0;
+    virtual double sampleRate() const = 0; // Hz
+    virtual size_t numSamples() const = 0;
+    virtual uint16_t lineMask() const = 0;         // Bit n is set if line n was recorded
+    virtual int64_t firstSampleNumber() const = 0; // Sample number of the acquisition system at sample 0
+
+    /**
+     * @brief Reads the packed words of a range of samples; reading the samples in order is fastest.
+     *
+     * @param first first sample
+     * @param count number of samples; first + count must not exceed numSamples()
+     * @param words set to one word per sample, bit n is line n
+     */
+    virtual void read(size_t first, size_t count, uint16_t *words) = 0;
+
+    const std::string &error() const { return error_; }
+
+protected:
+    bool fail(const std::string &error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    std::string error_;
+};
+
+/**
+ * @brief Reads one chunk of a recording into one bit plane per recorded line (see DigitalLineReader::lineMask).
+ *
+ * Chunks of READER_CHUNK_SAMPLES samples read in order concatenate into whole planes; decoders carry their state from
+ * one chunk to the next instead (see FrameSearch).
+ *
+ * @param first first sample of the chunk
+ * @param count number of samples; first + count must not exceed numSamples()
+ * @param words room for count words
+ * @return std::vector<BitPlane> READER_MAX_LINES planes, line 0 first; the planes of lines not recorded are empty
+ */
+inline std::vector<BitPlane> readBitPlaneChunk(DigitalLineReader &reader, size_t first, size_t count, uint16_t *words)
+{
+    reader.read(first, count, words);
+    return transposeToBitPlanes(reinterpret_cast<const uint8_t *>(words), count, 2, READER_MAX_LINES,
+                                reader.lineMask());
+}
+
+/**
+ * @brief Directory part of a path, without the trailing slash; "." if there is none.
+ */
+inline std::string parentDirectory(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+/**
+ * @brief Last component of a path.
+ */
+inline std::string baseName(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * @brief Board digital inputs of an Intan .rhd file.
+ */
+class RhdReader : public DigitalLineReader
+{
+public:
+    bool open(const std::string &path) { return file_.open(path) || fail(file_.error()); }
+
+    const char *formatName() const override { return "Intan RHD"; }
+    double sampleRate() const override { return file_.header().sampleRate; }
+    size_t numSamples() const override { return file_.numSamples(); }
+    uint16_t lineMask() const override { return file_.header().digitalInMask; }
+    int64_t firstSampleNumber() const override { return file_.firstTimestamp(); }
+    void read(size_t first, size_t count, uint16_t *words) override { file_.readDigitalIn(first, count, words); }
+
+private:
+    RhdFile file_;
+};
+
+/**
+ * @brief digitalin.dat of an Intan one-file-per-signal-type recording.
+ */
+class IntanDigitalInReader : public DigitalLineReader
+{
+public:
+    bool open(const std::string &path)
+    {
+        std::string directory = parentDirectory(path);
+        MappedFile info;
+        if (!info.open(directory + "/info.rhd"))
+            return fail(info.error());
+        RhdHeaderParser parser(info.data(), info.size());
+        if (!parser.parse(header_))
+            return fail(directory + "/info.rhd: " + parser.error());
+        if (!file_.open(path))
+            return fail(file_.error());
+
+        // Intan timestamps of all samples; only the first is needed
+        MappedFile time;
+        if (time.open(directory + "/time.dat") && time.size() >= sizeof(int32_t))
+            std::memcpy(&firstTimestamp_, time.data(), sizeof(int32_t));
+        return true;
+    }
+
+    const char *formatName() const override { return "Intan digitalin.dat"; }
+    double sampleRate() const override { return header_.sampleRate; }
+    size_t numSamples() const override { return file_.size() / sizeof(uint16_t); }
+    uint16_t lineMask() const override { return header_.digitalInMask; }
+    int64_t firstSampleNumber() const override { return firstTimestamp_; }
+
+    void read(size_t first, size_t count, uint16_t *words) override
+    {
+        std::memcpy(words, file_.data() + first * sizeof(uint16_t), count * sizeof(uint16_t));
+    }
+
+private:
+    MappedFile file_;
+    RhdHeader header_;
+    int32_t firstTimestamp_ = 0;
+};
+
+/**
+ * @brief Memory-mapped one-dimensional NumPy .npy array of integers.
+ */
+class NpyArray
+{
+public:
+    /**
+     * @return false if the file is not a one-dimensional little-endian integer array; error() tells why
+     */
+    bool open(const std::string &path)
+    {
+        if (!file_.open(path))
+            return fail(file_.error());
+        const uint8_t *data = file_.data();
+        if (file_.size() < 10 || std::memcmp(data, "\x93NUMPY", 6) != 0)
+            return fail(path + ": not an .npy file");
+
+        // Version 1 has a 16-bit header length, later versions a 32-bit one
+        size_t headerLength = data[8] | (size_t(data[9]) << 8);
+        size_t headerStart = 10;
+        if (data[6] > 1)
+        {
+            if (file_.size() < 12)
+                return fail(path + ": truncated .npy header");
+            headerLength |= (size_t(data[10]) << 16) | (size_t(data[11]) << 24);
+            headerStart = 12;
+        }
+        if (headerStart + headerLength > file_.size())
+            return fail(path + ": truncated .npy header");
+        std::string header(reinterpret_cast<const char *>(data + headerStart), headerLength);
+
+        // {'descr': '<i8', 'fortran_order': False, 'shape': (n,), }
+        size_t descr = header.find("'descr'");
+        size_t type = descr == std::string::npos ? descr : header.find('\'', header.find(':', descr));
+        size_t shape = header.find("'shape'");
+        if (type == std::string::npos || shape == std::string::npos || type + 4 > header.size())
+            return fail(path + ": unsupported .npy header");
+        char order = header[type + 1];
+        kind_ = header[type + 2];
+        itemSize_ = size_t(std::atoi(header.c_str() + type + 3));
+        if ((order != '<' && order != '|') || (kind_ != 'i' && kind_ != 'u') ||
+            (itemSize_ != 1 && itemSize_ != 2 && itemSize_ != 4 && itemSize_ != 8))
+            return fail(path + ": unsupported .npy type " + header.substr(type + 1, 3));
+        size_t open = header.find('(', shape);
+        if (open == std::string::npos)
+            return fail(path + ": unsupported .npy header");
+        size_ = size_t(std::strtoull(header.c_str() + open + 1, NULL, 10));
+
+        values_ = data + headerStart + headerLength;
+        if (size_t(file_.data() + file_.size() - values_) < size_ * itemSize_)
+            return fail(path + ": truncated .npy data");
+        return true;
+    }
+
+    size_t size() const { return size_; }
+    const std::string &error() const { return error_; }
+
+    int64_t operator[](size_t i) const
+    {
+        const uint8_t *value = values_ + i * itemSize_;
+        switch (itemSize_)
+        {
+        case 1:
+            return kind_ == 'i' ? int64_t(int8_t(*value)) : int64_t(*value);
+        case 2:
+            return kind_ == 'i' ? int64_t(load<int16_t>(value)) : int64_t(load<uint16_t>(value));
+        case 4:
+            return kind_ == 'i' ? int64_t(load<int32_t>(value)) : int64_t(load<uint32_t>(value));
+        default:
+            return load<int64_t>(value);
+        }
+    }
+
+private:
+    template <typename T>
+    static T load(const uint8_t *value)
+    {
+        T result;
+        std::memcpy(&result, value, sizeof(T));
+        return result;
+    }
+
+    bool fail(const std::string &error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    MappedFile file_;
+    const uint8_t *values_ = NULL;
+    size_t size_ = 0;
+    size_t itemSize_ = 0;
+    char kind_ = 'i';
+    std::string error_;
+};
+
+/**
+ * @brief TTL lines of an Open Ephys binary stream, replayed from its events onto the samples of its continuous.dat.
+ *
+ * The lines are taken as LOW before their first event.
+ */
+class OpenEphysReader : public DigitalLineReader
+{
+public:
+    /**
+     * @param path continuous.dat of the stream (<recording>/continuous/<stream>/continuous.dat)
+     */
+    bool open(const std::string &path)
+    {
+        std::string streamDirectory = parentDirectory(path);
+        std::string stream = baseName(streamDirectory);
+        std::string recording = parentDirectory(parentDirectory(streamDirectory));
+        std::string events = recording + "/events/" + stream + "/TTL/";
+        if (!continuousSamples_.open(streamDirectory + "/sample_numbers.npy"))
+            return fail(continuousSamples_.error());
+        if (!eventSamples_.open(events + "sample_numbers.npy"))
+            return fail(eventSamples_.error());
+        if (!eventStates_.open(events + "states.npy"))
+            return fail(eventStates_.error());
+        if (eventSamples_.size() != eventStates_.size())
+            return fail(events + ": sample_numbers.npy and states.npy differ in length");
+        firstSampleNumber_ = continuousSamples_.size() > 0 ? continuousSamples_[0] : 0;
+        for (size_t k = 0; k < eventStates_.size(); k++)
+        {
+            int64_t line = std::abs(eventStates_[k]) - 1;
+            if (line >= 0 && line < READER_MAX_LINES)
+                lineMask_ |= uint16_t(1 << line);
+        }
+        return readSampleRate(recording + "/structure.oebin", stream);
+    }
+
+    const char *formatName() const override { return "Open Ephys"; }
+    double sampleRate() const override { return sampleRate_; }
+    size_t numSamples() const override { return continuousSamples_.size(); }
+    uint16_t lineMask() const override { return lineMask_; }
+    int64_t firstSampleNumber() const override { return firstSampleNumber_; }
+
+    void read(size_t first, size_t count, uint16_t *words) override
+    {
+        // Events are replayed in order; start over to read backwards
+        if (first < position_)
+        {
+            position_ = 0;
+            nextEvent_ = 0;
+            state_ = 0;
+        }
+        size_t end = first + count;
+        size_t sample = first;
+        while (sample < end)
+        {
+            // Apply the events up to this sample, then fill up to the next one
+            while (nextEvent_ < eventSamples_.size() && eventSample(nextEvent_) <= int64_t(sample))
+                applyEvent(nextEvent_++);
+            size_t until = end;
+            if (nextEvent_ < eventSamples_.size())
+                until = size_t(std::min<int64_t>(int64_t(end), eventSample(nextEvent_)));
+            std::fill(words + (sample - first), words + (until - first), state_);
+            sample = until;
+        }
+        position_ = end;
+    }
+
+private:
+    int64_t eventSample(size_t k) const { return eventSamples_[k] - firstSampleNumber_; }
+
+    void applyEvent(size_t k)
+    {
+        int64_t state = eventStates_[k];
+        int64_t line = std::abs(state) - 1;
+        if (line < 0 || line >= READER_MAX_LINES)
+            return;
+        state_ = state > 0 ? uint16_t(state_ | (1 << line)) : uint16_t(state_ & ~(1 << line));
+    }
+
+    /**
+     * @brief Finds the sample rate of the stream in structure.oebin: the first "sample_rate" after its folder name.
+     */
+    bool readSampleRate(const std::string &path, const std::string &stream)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return fail("cannot open " + path);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t folder = text.find("\"" + stream + "/\"");
+        size_t rate = folder == std::string::npos ? folder : text.find("\"sample_rate\"", folder);
+        size_t colon = rate == std::string::npos ? rate : text.find(':', rate);
+        if (colon == std::string::npos)
+            return fail(path + ": no sample rate for stream " + stream);
+        sampleRate_ = std::strtod(text.c_str() + colon + 1, NULL);
+        return sampleRate_ > 0.0 || fail(path + ": invalid sample rate for stream " + stream);
+    }
+
+    NpyArray continuousSamples_; // Sample number of every sample of continuous.dat
+    NpyArray eventSamples_;
+    NpyArray eventStates_; // Line number + 1, positive for a rising edge, negative for a falling one
+    double sampleRate_ = 0.0;
+    int64_t firstSampleNumber_ = 0;
+    uint16_t lineMask_ = 0;
+
+    // Replay position
+    size_t position_ = 0;
+    size_t nextEvent_ = 0;
+    uint16_t state_ = 0;
+};
+
+/**
+ * @brief Sync channel of a SpikeGLX .bin file (the SY channel of an imec stream, or the digital word of an NI stream).
+ */
+class SpikeGlxReader : public DigitalLineReader
+{
+public:
+    bool open(const std::string &path)
+    {
+        std::string metaPath = path.substr(0, path.size() - 4) + ".meta";
+        std::ifstream meta(metaPath);
+        if (!meta)
+            return fail("cannot open " + metaPath);
+        std::string line;
+        bool imec = false;
+        std::string digitalLines; // NI digital lines, e.g. "0:7" or "0,2,4:6"
+        size_t digitalBytes = 0;
+        int digitalWords = -1; // Last count of snsMnMaXaDw, the digital words saved per sample
+        while (std::getline(meta, line))
+        {
+            size_t equals = line.find('=');
+            if (equals == std::string::npos)
+                continue;
+            std::string key = line.substr(0, equals);
+            const char *value = line.c_str() + equals + 1;
+            if (key == "nSavedChans")
+                numChannels_ = size_t(std::atoi(value));
+            else if (key == "imSampRate" || key == "niSampRate")
+            {
+                sampleRate_ = std::strtod(value, NULL);
+                imec = imec || key == "imSampRate";
+            }
+            else if (key == "firstSample")
+                firstSample_ = std::strtoll(value, NULL, 10);
+            else if (key == "typeThis")
+                imec = imec || std::strcmp(value, "imec") == 0;
+            else if (key == "niXDChans1")
+                digitalLines = value;
+            else if (key == "niXDBytes1")
+                digitalBytes = size_t(std::atoi(value));
+            else if (key == "snsMnMaXaDw")
+                digitalWords = std::atoi(line.c_str() + line.rfind(',') + 1);
+        }
+        if (numChannels_ == 0 || sampleRate_ <= 0.0)
+            return fail(metaPath + ": missing nSavedChans or sample rate");
+        syncChannel_ = numChannels_ - 1;
+        if (imec)
+            lineMask_ = uint16_t(1 << SPIKEGLX_IMEC_SYNC_BIT);
+        else if (digitalWords != 0 && !digitalLines.empty())
+            lineMask_ = nidqLineMask(digitalLines, digitalBytes);
+        // Without a digital word, the last saved channel of an NI stream is analog
+        if (lineMask_ == 0)
+            return fail(metaPath + ": no sync channel (neither an imec stream nor digital lines in niXDChans1)");
+        return file_.open(path) || fail(file_.error());
+    }
+
+    const char *formatName() const override { return "SpikeGLX"; }
+    double sampleRate() const override { return sampleRate_; }
+    size_t numSamples() const override { return file_.size() / (numChannels_ * sizeof(int16_t)); }
+    uint16_t lineMask() const override { return lineMask_; }
+    int64_t firstSampleNumber() const override { return firstSample_; }
+
+    void read(size_t first, size_t count, uint16_t *words) override
+    {
+        // One word per sample, numChannels_ words apart; with hundreds of channels, each is on its own cache line
+        const size_t stride = numChannels_ * sizeof(int16_t);
+        const uint8_t *word = file_.data() + first * stride + syncChannel_ * sizeof(int16_t);
+        const uint8_t *end = file_.data() + file_.size();
+        for (size_t i = 0; i < count; i++, word += stride)
+        {
+            if (word + SPIKEGLX_PREFETCH_SAMPLES * stride < end)
+                __builtin_prefetch(word + SPIKEGLX_PREFETCH_SAMPLES * stride);
+            std::memcpy(words + i, word, sizeof(uint16_t));
+        }
+    }
+
+private:
+    /**
+     * @brief Lines of the last digital word of an NI stream that niXDChans1 lists as recorded.
+     *
+     * @param lines comma-separated lines and ranges of lines, e.g. "0,2,4:6"
+     * @param bytes niXDBytes1, the bytes of digital words saved per sample; lines below the last word are dropped
+     */
+    static uint16_t nidqLineMask(const std::string &lines, size_t bytes)
+    {
+        const int firstLine = bytes > 2 ? int(16 * ((bytes + 1) / 2 - 1)) : 0; // First line of the last word
+        uint16_t mask = 0;
+        const char *range = lines.c_str();
+        while (true)
+        {
+            char *end;
+            int low = int(std::strtol(range, &end, 10));
+            if (end == range)
+                break;
+            int high = *end == ':' ? int(std::strtol(end + 1, &end, 10)) : low;
+            for (int line = std::max(low, firstLine); line <= high && line < firstLine + READER_MAX_LINES; line++)
+                mask |= uint16_t(1 << (line - firstLine));
+            if (*end != ',')
+                break;
+            range = end + 1;
+        }
+        return mask;
+    }
+
+    MappedFile file_;
+    size_t numChannels_ = 0;
+    size_t syncChannel_ = 0;
+    double sampleRate_ = 0.0;
+    int64_t firstSample_ = 0;
+    uint16_t lineMask_ = 0;
+};
+
+/**
+ * @brief Opens a recording with the reader for its format, chosen by its file name.
+ *
+ * @param path .rhd file, digitalin.dat, Open Ephys continuous.dat, or SpikeGLX .bin (with a .meta next to it)
+ * @param error set if the recording has a known format but cannot be read
+ * @return std::unique_ptr<DigitalLineReader> NULL if the format is not known (e.g. a raw capture) or on error
+ */
+inline std::unique_ptr<DigitalLineReader> openDigitalLineReader(const std::string &path, std::string &error)
+{
+    auto endsWith = [&path](const char *suffix) {
+        size_t n = std::strlen(suffix);
+        return path.size() >= n && path.compare(path.size() - n, n, suffix) == 0;
+    };
+    std::string name = baseName(path);
+
+    error.clear();
+    if (endsWith(".rhd"))
+    {
+        std::unique_ptr<RhdReader> reader(new RhdReader());
+        if (reader->open(path))
+            return reader;
+        error = reader->error();
+    }
+    else if (name == "digitalin.dat")
+    {
+        std::unique_ptr<IntanDigitalInReader> reader(new IntanDigitalInReader());
+        if (reader->open(path))
+            return reader;
+        error = reader->error();
+    }
+    else if (name == "continuous.dat")
+    {
+        std::unique_ptr<OpenEphysReader> reader(new OpenEphysReader());
+        if (reader->open(path))
+            return reader;
+        error = reader->error();
+    }
+    else if (endsWith(".bin") && std::ifstream(path.substr(0, path.size() - 4) + ".meta").good())
+    {
+        std::unique_ptr<SpikeGlxReader> reader(new SpikeGlxReader());
+        if (reader->open(path))
+            return reader;
+        error = reader->error();
+    }
+    return NULL;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+/**
+ * Fusion of a recorded dual-rate sync stream (see dual_rate_sync.cpp) into one dense, absolute timeline.
+ *
+ * The sequence line gives dense alignment points: once unwrapped, its sequence numbers count SEQUENCE_PERIOD samples
+ * of the sender's sample clock. The timestamp line gives the CPU time of every SEQUENCE_FRAMES_PER_TIMESTAMP-th of
+ * those points, identified by the sequence frame that starts together with it. Every sequence frame is then placed
+ * on the CPU clock by interpolating linearly, in sequence numbers, between the surrounding timestamp frames, which
+ * also absorbs drift between the two clocks.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "batch_decoder.cpp"
+
+/**
+ * @brief Dense timeline as a struct of arrays; one entry per clean sequence frame.
+ */
+struct FusedTimeline
+{
+    std::vector<uint64_t> samples;  // Recording sample at the start of the sequence frame
+    std::vector<uint64_t> sequence; // Unwrapped sequence number, relative to the first frame modulo 2^SEQUENCE_BITS
+    std::vector<double> timeUS;     // CPU time (getCPUClockTimeUS) of the frame start; NaN without timestamp frames
+
+    size_t size() const { return samples.size(); }
+};
+
+/**
+ * @brief Unwraps a sequence number given the previous one and the recording samples between them.
+ *
+ * Of all values congruent to the received number, the one closest to the number of sequence periods that elapsed is
+ * used, so gaps of any length (e.g. a dropped stretch of the recording) unwrap correctly.
+ */
+inline uint64_t unwrapSequence(uint64_t previous, uint64_t previousSample, uint64_t received, uint64_t sample)
+{
+    const int64_t wrap = int64_t(1) << SEQUENCE_BITS;
+    int64_t elapsed = std::llround(double(sample - previousSample) / SEQUENCE_PERIOD);
+    int64_t delta = (int64_t(received) - int64_t(previous)) & (wrap - 1);
+    delta += int64_t(std::floor(double(elapsed - delta) / wrap + 0.5)) * wrap;
+    return uint64_t(int64_t(previous) + delta);
+}
+
+/**
+ * @brief Decodes both lines of a dual-rate recording and fuses them into a dense timeline.
+ *
+ * The recording must be sampled at the sender's sample rate (DIGIT_SAMPLE_HZ * DIGIT_REPEATS).
+ *
+ * @tparam Samples const uint8_t * (one byte per sample) or BitPlane
+ * @param sequenceLine recording of the sequence line
+ * @param timestampLine recording of the timestamp line
+ * @param numSamples number of samples of each line
+ * @param fec whether the timestamp frames carry Hamming check digits
+ * @return FusedTimeline
+ */
+template <typename Samples>
+FusedTimeline fuseDualRate(const Samples &sequenceLine, const Samples &timestampLine, size_t numSamples,
+                           bool fec = false)
+{
+    const FrameFormat sequenceFormat = FrameFormat::sequence();
+    const FrameFormat timestampFormat = FrameFormat::timestamp(fec);
+    const double nominalFrameUS = SEQUENCE_PERIOD * 1e6 / (DIGIT_SAMPLE_HZ * DIGIT_REPEATS);
+
+    std::vector<uint64_t> sequenceStarts = findFrameStarts(sequenceLine, numSamples, sequenceFormat);
+    DecodedFrames sequenceFrames =
+        decodeFrames(sequenceLine, numSamples, sequenceStarts.data(), sequenceStarts.size(), sequenceFormat);
+    std::vector<uint64_t> timestampStarts = findFrameStarts(timestampLine, numSamples, timestampFormat);
+    DecodedFrames timestampFrames =
+        decodeFrames(timestampLine, numSamples, timestampStarts.data(), timestampStarts.size(), timestampFormat);
+
+    // Clean sequence frames, unwrapped
+    FusedTimeline timeline;
+    for (size_t i = 0; i < sequenceFrames.size(); i++)
+    {
+        if ((sequenceFrames.flags[i] & ~FRAME_CORRECTED) != 0)
+            continue;
+        uint64_t sequence = sequenceFrames.timestamps[i];
+        if (!timeline.samples.empty())
+            sequence = unwrapSequence(timeline.sequence.back(), timeline.samples.back(), sequence, sequenceStarts[i]);
+        timeline.samples.push_back(sequenceStarts[i]);
+        timeline.sequence.push_back(sequence);
+    }
+    timeline.timeUS.assign(timeline.size(), std::numeric_limits<double>::quiet_NaN());
+
+    // Anchor each clean timestamp frame to the sequence frame starting at the same sample (within one sequence digit)
+    std::vector<uint64_t> anchorSequence;
+    std::vector<double> anchorTimeUS;
+    size_t j = 0;
+    for (size_t i = 0; i < timestampFrames.size(); i++)
+    {
+        if ((timestampFrames.flags[i] & ~FRAME_CORRECTED) != 0)
+            continue;
+        uint64_t start = timestampStarts[i];
+        while (j < timeline.size() && timeline.samples[j] + SEQUENCE_DIGIT_REPEATS < start)
+            j++;
+        if (j < timeline.size() && timeline.samples[j] <= start + SEQUENCE_DIGIT_REPEATS)
+        {
+            anchorSequence.push_back(timeline.sequence[j]);
+            anchorTimeUS.push_back(double(timestampFrames.timestamps[i]));
+        }
+    }
+    if (anchorSequence.empty())
+        return timeline;
+
+    // Interpolate between the surrounding anchors; extrapolate from the nearest pair (or the nominal rate) outside them
+    size_t a = 0;
+    for (size_t i = 0; i < timeline.size(); i++)
+    {
+        double sequence = double(timeline.sequence[i]);
+        while (a + 2 < anchorSequence.size() && double(anchorSequence[a + 1]) <= sequence)
+            a++;
+        if (anchorSequence.size() == 1 || anchorSequence[a + 1] == anchorSequence[a])
+        {
+            timeline.timeUS[i] = anchorTimeUS[a] + (sequence - double(anchorSequence[a])) * nominalFrameUS;
+            continue;
+        }
+        double s0 = double(anchorSequence[a]);
+        double s1 = double(anchorSequence[a + 1]);
+        double t0 = anchorTimeUS[a];
+        double t1 = anchorTimeUS[a + 1];
+        timeline.timeUS[i] = t0 + (sequence - s0) * (t1 - t0) / (s1 - s0);
+    }
+    return timeline;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bitcode.cpp"
+
+constexpr int DUAL_RATE_BLOCK_LENGTH = 4000; // Samples rendered per refill (100 ms)
+constexpr int DUAL_RATE_BUFFER_BLOCKS = 4;   // Blocks held in the device buffer; bounds latency and underflow margin
+
+// The first timestamp frame must be rendered after the task has started, when the sample clock can be related to the
+// CPU clock
+static_assert(DUAL_RATE_BLOCK_LENGTH * DUAL_RATE_BUFFER_BLOCKS <= TIMESTAMP_PERIOD,
+              "Device buffer must not reach the first timestamp frame");
+
+struct DualRateSyncConfig
+{
+    std::string name = "dualRate";            // Task name; must be unique per process
+    std::string device = "Dev2";
+    std::string sequenceLine = "port0/line1"; // Fast line: SEQUENCE_BITS-bit sequence number every SEQUENCE_PERIOD
+    std::string timestampLine = "port0/line4"; // Slow line: getCPUClockTimeUS every TIMESTAMP_PERIOD
+    bool fec = false;                         // Append Hamming check digits to the timestamp frames
+};
+
+/**
+ * @brief Streams dual-rate sync codes on two lines of one continuous, hardware-timed DO task.
+ *
+ * Sequence frame f starts at sample f * SEQUENCE_PERIOD and carries f modulo 2^SEQUENCE_BITS; timestamp frame g
+ * (g >= 1) starts at sample g * TIMESTAMP_PERIOD, together with sequence frame g * SEQUENCE_FRAMES_PER_TIMESTAMP, and
+ * carries the CPU time at which that sample is generated. Because both lines share the sample clock, every sequence
+ * frame can be placed on the absolute timeline between the surrounding timestamp frames (see dual_rate_fusion.cpp).
+ *
+ * Blocks are rendered just before the device needs them (regeneration is disabled). The CPU time of a future sample is
+ * predicted from the most recent (generated samples, CPU time) pair, measured right before each refill, so its error is
+ * the time taken to query the generated sample count.
+ */
+class DualRateSync
+{
+public:
+    explicit DualRateSync(DualRateSyncConfig config) : config_(std::move(config)) {}
+
+    ~DualRateSync() { stop(); }
+
+    DualRateSync(const DualRateSync &) = delete;
+    DualRateSync &operator=(const DualRateSync &) = delete;
+
+    /**
+     * @brief Starts the streaming thread, which creates the NI-DAQ task and keeps its buffer filled.
+     */
+    void start()
+    {
+        if (thread_.joinable())
+            return;
+        keepRunning_ = true;
+        thread_ = std::thread(&DualRateSync::run, this);
+    }
+
+    /**
+     * @brief Stops the stream after the block in flight; a frame cut off by the stop is flagged by the decoder.
+     */
+    void stop()
+    {
+        keepRunning_ = false;
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    const DualRateSyncConfig &config() const { return config_; }
+
+private:
+    /**
+     * @brief Renders the next block of both lines; the sequence line first, then the timestamp line.
+     */
+    void renderBlock(uInt8 *block, int length)
+    {
+        const FrameFormat sequenceFormat = FrameFormat::sequence();
+        const FrameFormat timestampFormat = FrameFormat::timestamp(config_.fec);
+        uInt8 *sequenceLine = block;
+        uInt8 *timestampLine = block + length;
+
+        for (int i = 0; i < length; i++)
+        {
+            uint64_t sample = position_ + i;
+
+            uint64_t frame = sample / SEQUENCE_PERIOD;
+            int offset = int(sample % SEQUENCE_PERIOD);
+            if (offset == 0)
+                convertIntToDigits(frame, sequenceFormat, sequenceDigits_);
+            sequenceLine[i] = offset < sequenceFormat.length() ? sequenceDigits_[offset / SEQUENCE_DIGIT_REPEATS] : 0;
+
+            frame = sample / TIMESTAMP_PERIOD;
+            offset = int(sample % TIMESTAMP_PERIOD);
+            if (offset == 0 && frame > 0)
+                convertIntToDigits(predictCPUClockTimeUS(sample), timestampFormat, timestampDigits_);
+            timestampLine[i] =
+                frame > 0 && offset < timestampFormat.length() ? timestampDigits_[offset / DIGIT_REPEATS] : 0;
+        }
+        position_ += length;
+    }
+
+    /**
+     * @brief Predicts the CPU time at which a sample will be generated.
+     */
+    uint64_t predictCPUClockTimeUS(uint64_t sample) const
+    {
+        double ahead = (double(sample) - double(anchorSample_)) / SAMPLE_RATE;
+        return uint64_t(int64_t(anchorTimeUS_) + int64_t(ahead * 1e6));
+    }
+
+    /**
+     * @brief Relates the sample clock to the CPU clock using the number of samples generated so far.
+     */
+    void updateAnchor(TaskHandle task)
+    {
+        uint64_t before = getCPUClockTimeUS();
+        uInt64 generated = 0;
+        handleError(DAQmxGetWriteTotalSampPerChanGenerated(task, &generated));
+        uint64_t after = getCPUClockTimeUS();
+        anchorSample_ = generated;
+        anchorTimeUS_ = before + (after - before) / 2;
+    }
+
+    /**
+     * @brief Creates the DO task and streams until stop().
+     */
+    void run()
+    {
+        TaskHandle task = NULL;
+        std::string lines = config_.device + "/" + config_.sequenceLine + "," + config_.device + "/" +
+                            config_.timestampLine;
+        handleError(DAQmxCreateTask(config_.name.c_str(), &task));
+        handleError(DAQmxCreateDOChan(task, lines.c_str(), "", DAQmx_Val_ChanPerLine));
+        handleError(DAQmxCfgSampClkTiming(task, "", SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_ContSamps,
+                                          DUAL_RATE_BLOCK_LENGTH * DUAL_RATE_BUFFER_BLOCKS));
+        handleError(DAQmxSetWriteRegenMode(task, DAQmx_Val_DoNotAllowRegen));
+        handleError(DAQmxSetBufOutputBufSize(task, DUAL_RATE_BLOCK_LENGTH * DUAL_RATE_BUFFER_BLOCKS));
+
+        // Both lines of one block, grouped by channel
+        std::vector<uInt8> block(2 * DUAL_RATE_BLOCK_LENGTH);
+        position_ = 0;
+
+        // Pre-fill the device buffer before starting; it holds no timestamp frames
+        for (int i = 0; i < DUAL_RATE_BUFFER_BLOCKS; i++)
+        {
+            renderBlock(block.data(), DUAL_RATE_BLOCK_LENGTH);
+            handleError(DAQmxWriteDigitalLines(task, DUAL_RATE_BLOCK_LENGTH, false, 10.0, DAQmx_Val_GroupByChannel,
+                                               block.data(), NULL, NULL));
+        }
+        handleError(DAQmxStartTask(task));
+        anchorSample_ = 0;
+        anchorTimeUS_ = getCPUClockTimeUS();
+
+        // Refill loop; the write blocks until a block of buffer space is free
+        while (keepRunning_)
+        {
+            updateAnchor(task);
+            renderBlock(block.data(), DUAL_RATE_BLOCK_LENGTH);
+            handleError(DAQmxWriteDigitalLines(task, DUAL_RATE_BLOCK_LENGTH, false, 10.0, DAQmx_Val_GroupByChannel,
+                                               block.data(), NULL, NULL));
+        }
+
+        handleError(DAQmxStopTask(task));
+        handleError(DAQmxClearTask(task));
+    }
+
+    // Written by the caller of start()/stop()
+    DualRateSyncConfig config_;
+    std::atomic<bool> keepRunning_{false};
+    std::thread thread_;
+
+    // Used by the streaming thread only
+    uint64_t position_ = 0;     // Sample at the start of the next block
+    uint64_t anchorSample_ = 0; // Samples generated at anchorTimeUS_
+    uint64_t anchorTimeUS_ = 0;
+    uint8_t sequenceDigits_[SEQUENCE_BITS + 4] = {};
+    uint8_t timestampDigits_[NUM_DIGITS_FEC] = {};
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+constexpr size_t CACHE_LINE_SIZE = 64; // Bytes; keeps independently written state on separate cache lines
+
+/**
+ * @brief Bounded lock-free queue for passing events from producer threads to a sender thread.
+ *
+ * Any number of threads may push; one thread pops. Each slot carries a sequence number that tells producers and the
+ * consumer whether it is free or filled (Vyukov's bounded queue), so neither side takes a lock or allocates after
+ * construction. The producer and consumer positions live on separate cache lines.
+ *
+ * @tparam T trivially copyable event type
+ */
+template <typename T>
+class EventQueue
+{
+public:
+    /**
+     * @param capacity maximum number of queued events; rounded up to a power of two
+     */
+    explicit EventQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        mask_ = size - 1;
+        slots_ = std::make_unique<Slot[]>(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Adds an event; safe to call from any thread.
+     *
+     * @param event event to add
+     * @return false if the queue is full and the event was dropped
+     */
+    bool push(const T &event)
+    {
+        size_t position = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot &slot = slots_[position & mask_];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0)
+            {
+                if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    slot.event = event;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Removes the oldest event; call from the consumer thread only.
+     *
+     * @param event set to the removed event
+     * @return false if the queue is empty
+     */
+    bool pop(T &event)
+    {
+        size_t position = head_.load(std::memory_order_relaxed);
+        Slot &slot = slots_[position & mask_];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+        {
+            return false;
+        }
+        event = slot.event;
+        slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+        head_.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @return size_t approximate number of queued events
+     */
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        T event;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0}; // Next position to push; shared by producers
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_{0}; // Next position to pop; consumer only
+    alignas(CACHE_LINE_SIZE) std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+};
@@ -0,0 +1,56 @@
+/**
+ * This file fuses a recording of the two dual-rate sync lines into a dense, absolute timeline, offline and without a
+ * NI-DAQ board.
+ *
+ * The recording is a raw packed port capture ("port8", "port16" or "port32": 8, 16 or 32 lines per sample) sampled at
+ * SAMPLE_RATE; the sequence and timestamp lines are given by their bit in the port. The timeline is printed as CSV
+ * lines "sample,sequence,time_us"; a summary goes to stderr.
+ *
+ * Usage: ./fuse_dual_rate recording.bin port16 sequenceLine timestampLine [fec] > timeline.csv
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "bit_planes.cpp"
+#include "dual_rate_fusion.cpp"
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        std::cerr << "Usage: " << argv[0] << " recording.bin port8|port16|port32 sequenceLine timestampLine [fec]"
+                  << std::endl;
+        return 1;
+    }
+    int portBytes = std::strcmp(argv[2], "port8") == 0 ? 1 : std::strcmp(argv[2], "port16") == 0 ? 2 : 4;
+    int sequenceLine = std::atoi(argv[3]);
+    int timestampLine = std::atoi(argv[4]);
+    bool fec = argc > 5 && std::strcmp(argv[5], "fec") == 0;
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> samples((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t numSamples = samples.size() / portBytes;
+    int numLines = std::max(sequenceLine, timestampLine) + 1;
+    std::vector<BitPlane> planes = transposeToBitPlanes(samples.data(), numSamples, portBytes, numLines);
+    FusedTimeline timeline = fuseDualRate(planes[sequenceLine], planes[timestampLine], numSamples, fec);
+
+    std::cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < timeline.size(); i++)
+    {
+        std::cout << timeline.samples[i] << "," << timeline.sequence[i] << "," << timeline.timeUS[i] << "\n";
+    }
+    std::cerr << "Fused " << timeline.size() << " sequence frames" << std::endl;
+    return 0;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+/**
+ * Allocation and syscall guard for the host-side stages of a send (compile with -DBITCODE_GUARD).
+ *
+ * Each guarded stage counts operator new calls, syscalls and context switches of the sender thread. Stages are
+ * expected to do none of these in steady state; any observed after the first (warm-up) send is a violation, and
+ * hotPathViolations lets the program exit with a failure. Without BITCODE_GUARD, HOT_PATH_SCOPE compiles to nothing.
+ */
+
+#ifdef BITCODE_GUARD
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+
+#include "../common/perf_counters.cpp"
+
+thread_local uint64_t guardAllocationCount = 0; // operator new calls on this thread
+std::atomic<uint64_t> hotPathViolations(0);     // Guarded stages (all threads) that allocated or entered the kernel
+
+void *operator new(size_t size)
+{
+    guardAllocationCount++;
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+/**
+ * @brief Reads the tracepoint id of raw_syscalls:sys_enter from tracefs.
+ *
+ * @return uint64_t id, or 0 if tracefs is not readable
+ */
+inline uint64_t syscallTracepointId()
+{
+    for (const char *path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                             "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"})
+    {
+        std::ifstream file(path);
+        uint64_t id = 0;
+        if (file >> id)
+            return id;
+    }
+    return 0;
+}
+
+/**
+ * @brief Per-thread counters and per-stage results of the guard.
+ */
+class HotPathGuard
+{
+public:
+    struct Counts
+    {
+        uint64_t allocations = 0;
+        uint64_t syscalls = 0;
+        uint64_t contextSwitches = 0;
+    };
+
+    HotPathGuard()
+    {
+        // Context switches and syscalls happen in kernel mode, so user-mode counters would never count them. Context
+        // switches are then taken from getrusage; syscalls are not counted.
+        bool countsKernel = false;
+        contextSwitchFd_ =
+            openThreadPerfCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0, &countsKernel);
+        if (contextSwitchFd_ >= 0 && !countsKernel)
+        {
+            close(contextSwitchFd_);
+            contextSwitchFd_ = -1;
+        }
+        uint64_t tracepoint = syscallTracepointId();
+        syscallFd_ = tracepoint != 0 ? openThreadPerfCounter(PERF_TYPE_TRACEPOINT, tracepoint, -1, 0, &countsKernel)
+                                     : -1;
+        if (syscallFd_ >= 0 && !countsKernel)
+        {
+            close(syscallFd_);
+            syscallFd_ = -1;
+        }
+        if (syscallFd_ < 0)
+        {
+            std::cout << "Hot path guard: syscall counting unavailable (needs readable tracefs and "
+                      << "perf_event_paranoid <= 1 or CAP_PERFMON); allocations and context switches are still checked"
+                      << std::endl;
+        }
+
+        // Reading the counters is itself a syscall; measure that overhead with an empty scope
+        Counts begin = read();
+        Counts end = read();
+        overhead_.syscalls = end.syscalls - begin.syscalls;
+    }
+
+    ~HotPathGuard()
+    {
+        if (contextSwitchFd_ >= 0)
+            close(contextSwitchFd_);
+        if (syscallFd_ >= 0)
+            close(syscallFd_);
+    }
+
+    Counts read() const
+    {
+        Counts counts;
+        counts.allocations = guardAllocationCount;
+        counts.syscalls = readCounter(syscallFd_);
+        counts.contextSwitches = contextSwitchFd_ >= 0 ? readCounter(contextSwitchFd_) : threadContextSwitches();
+        return counts;
+    }
+
+    /**
+     * @brief Records the counts of one execution of a stage.
+     */
+    void record(const char *stage, const Counts &begin, const Counts &end)
+    {
+        Counts delta;
+        delta.allocations = end.allocations - begin.allocations;
+        delta.syscalls = end.syscalls - begin.syscalls - std::min(end.syscalls - begin.syscalls, overhead_.syscalls);
+        delta.contextSwitches = end.contextSwitches - begin.contextSwitches;
+
+        if (sends_ == 0)
+            return; // Warm-up: static tables and stream buffers are set up during the first send
+        if (delta.allocations == 0 && delta.syscalls == 0 && delta.contextSwitches == 0)
+            return;
+
+        hotPathViolations++;
+        std::cout << "Hot path violation in " << stage << " (send " << sends_ << "): " << delta.allocations
+                  << " allocations, " << delta.syscalls << " syscalls, " << delta.contextSwitches
+                  << " context switches" << std::endl;
+    }
+
+    /**
+     * @brief Marks the end of a send.
+     */
+    void endSend() { sends_++; }
+
+private:
+    static uint64_t readCounter(int fd)
+    {
+        uint64_t value = 0;
+        if (fd >= 0 && ::read(fd, &value, sizeof(value)) != sizeof(value))
+            value = 0;
+        return value;
+    }
+
+    int contextSwitchFd_ = -1;
+    int syscallFd_ = -1;
+    Counts overhead_;
+    uint64_t sends_ = 0;
+};
+
+/**
+ * @brief Guard of the calling thread, created on first use.
+ */
+inline HotPathGuard &hotPathGuard()
+{
+    thread_local HotPathGuard guard;
+    return guard;
+}
+
+/**
+ * @brief Records the enclosing block as a guarded stage.
+ */
+class HotPathScope
+{
+public:
+    explicit HotPathScope(const char *stage) : stage_(stage), begin_(hotPathGuard().read()) {}
+    ~HotPathScope() { hotPathGuard().record(stage_, begin_, hotPathGuard().read()); }
+
+private:
+    const char *stage_;
+    HotPathGuard::Counts begin_;
+};
+
+#define HOT_PATH_SCOPE(stage) HotPathScope hotPathScope(stage)
+#define HOT_PATH_END_SEND() hotPathGuard().endSend()
+
+#else
+
+#define HOT_PATH_SCOPE(stage)
+#define HOT_PATH_END_SEND()
+
+#endif
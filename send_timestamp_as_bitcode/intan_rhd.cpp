@@ -0,0 +1,335 @@
+#pragma once
+
+/**
+ * Reader for the digital inputs of Intan RHD2000 recordings in the traditional .rhd format, to decode the sync lines
+ * recorded on the Intan board.
+ *
+ * An .rhd file is a header followed by fixed-size data blocks, each holding 60 samples (128 from format version 2.0)
+ * of every enabled signal: timestamps, then amplifier, auxiliary input, supply voltage, temperature sensor and board
+ * ADC channels, then one 16-bit word of board digital inputs per sample (bit n is DIN n), then the digital outputs.
+ * The header is parsed once to find the offset of the digital-in words in a block and the size of a block. The file
+ * is memory-mapped, and only those words are read, one contiguous run of 2 bytes per sample of the block, with the
+ * next blocks prefetched; the rest of each block (mostly amplifier data) is never touched.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bit_planes.cpp"
+#include "mapped_file.cpp"
+
+constexpr uint32_t RHD_MAGIC = 0xC6912702; // First word of every .rhd file
+constexpr int RHD_DIGITAL_IN_LINES = 16;   // Bits of a digital-in word
+constexpr int RHD_PREFETCH_BLOCKS = 8;     // Blocks prefetched ahead of the one being read
+constexpr size_t RHD_PREFETCH_STRIDE = 64; // Bytes; one prefetch per cache line
+
+/**
+ * @brief Signal types of .rhd channels, as stored in the header.
+ */
+enum RhdSignalType : int16_t
+{
+    RHD_AMPLIFIER = 0,
+    RHD_AUX_INPUT = 1,
+    RHD_SUPPLY_VOLTAGE = 2,
+    RHD_BOARD_ADC = 3,
+    RHD_BOARD_DIGITAL_IN = 4,
+    RHD_BOARD_DIGITAL_OUT = 5
+};
+
+/**
+ * @brief What the header tells about the layout of the data blocks.
+ */
+struct RhdHeader
+{
+    int versionMajor = 0;
+    int versionMinor = 0;
+    double sampleRate = 0.0;  // Hz
+    int samplesPerBlock = 60; // 60 before version 2.0, 128 from then on
+    int numAmplifier = 0;
+    int numAux = 0;           // Sampled once every 4 samples
+    int numSupply = 0;        // Sampled once per block
+    int numTemp = 0;          // Sampled once per block
+    int numAdc = 0;
+    int numDigitalIn = 0;
+    int numDigitalOut = 0;
+    uint16_t digitalInMask = 0; // Bit n is set if DIN n is enabled
+    size_t headerBytes = 0;     // Offset of the first data block
+    size_t blockBytes = 0;
+    size_t digitalInOffset = 0; // Offset of the digital-in words in a block
+};
+
+/**
+ * @brief Parses an .rhd header; reads never go past size bytes.
+ */
+class RhdHeaderParser
+{
+public:
+    RhdHeaderParser(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+    /**
+     * @return false if the header is truncated or not an .rhd header; error() tells why
+     */
+    bool parse(RhdHeader &header)
+    {
+        if (read<uint32_t>() != RHD_MAGIC)
+            return fail("not an .rhd file");
+        header.versionMajor = read<int16_t>();
+        header.versionMinor = read<int16_t>();
+        header.sampleRate = read<float>();
+        header.samplesPerBlock = header.versionMajor > 1 ? 128 : 60;
+        int version = header.versionMajor * 100 + header.versionMinor;
+
+        // Filter settings (dspEnabled, then cutoff and bandwidths, actual and desired), notch mode, impedance test
+        // frequencies, then three notes
+        skip(2 + 6 * 4 + 2 + 2 * 4);
+        for (int i = 0; i < 3; i++)
+            skipString();
+        if (version >= 101)
+            header.numTemp = read<int16_t>();
+        if (version >= 103)
+            skip(2); // Evaluation board mode
+        if (version >= 200)
+            skipString(); // Reference channel
+
+        int numGroups = read<int16_t>();
+        for (int g = 0; g < numGroups && ok_; g++)
+        {
+            skipString(); // Name
+            skipString(); // Prefix
+            int groupEnabled = read<int16_t>();
+            int numChannels = read<int16_t>();
+            skip(2); // Amplifier channels
+            if (groupEnabled == 0)
+                continue;
+            for (int c = 0; c < numChannels && ok_; c++)
+            {
+                skipString(); // Native name
+                skipString(); // Custom name
+                int nativeOrder = read<int16_t>();
+                skip(2); // Custom order
+                int signalType = read<int16_t>();
+                int channelEnabled = read<int16_t>();
+                skip(2 * 6 + 2 * 4); // Chip channel, stream, trigger settings; impedance magnitude and phase
+                if (channelEnabled == 0)
+                    continue;
+                countChannel(header, signalType, nativeOrder);
+            }
+        }
+        if (!ok_)
+            return fail("truncated header");
+        if (header.sampleRate <= 0.0)
+            return fail("invalid sample rate");
+
+        int n = header.samplesPerBlock;
+        header.headerBytes = position_;
+        header.digitalInOffset = 4 * size_t(n) + 2 * size_t(n) * header.numAmplifier +
+                                 2 * size_t(n / 4) * header.numAux + 2 * size_t(header.numSupply) +
+                                 2 * size_t(header.numTemp) + 2 * size_t(n) * header.numAdc;
+        header.blockBytes = header.digitalInOffset + (header.numDigitalIn > 0 ? 2 * size_t(n) : 0) +
+                            (header.numDigitalOut > 0 ? 2 * size_t(n) : 0);
+        return true;
+    }
+
+    const std::string &error() const { return error_; }
+
+private:
+    template <typename T>
+    T read()
+    {
+        T value = T();
+        if (position_ + sizeof(T) > size_)
+        {
+            ok_ = false;
+            return value;
+        }
+        std::memcpy(&value, data_ + position_, sizeof(T));
+        position_ += sizeof(T);
+        return value;
+    }
+
+    void skip(size_t bytes)
+    {
+        ok_ = ok_ && position_ + bytes <= size_;
+        position_ = ok_ ? position_ + bytes : size_;
+    }
+
+    // QString: byte length (0xFFFFFFFF for a null string), then UTF-16 characters
+    void skipString()
+    {
+        uint32_t length = read<uint32_t>();
+        if (length != 0xFFFFFFFF)
+            skip(length);
+    }
+
+    void countChannel(RhdHeader &header, int signalType, int nativeOrder)
+    {
+        switch (signalType)
+        {
+        case RHD_AMPLIFIER:
+            header.numAmplifier++;
+            break;
+        case RHD_AUX_INPUT:
+            header.numAux++;
+            break;
+        case RHD_SUPPLY_VOLTAGE:
+            header.numSupply++;
+            break;
+        case RHD_BOARD_ADC:
+            header.numAdc++;
+            break;
+        case RHD_BOARD_DIGITAL_IN:
+            header.numDigitalIn++;
+            if (nativeOrder >= 0 && nativeOrder < RHD_DIGITAL_IN_LINES)
+                header.digitalInMask |= uint16_t(1 << nativeOrder);
+            break;
+        case RHD_BOARD_DIGITAL_OUT:
+            header.numDigitalOut++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    bool fail(const char *error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    const uint8_t *data_;
+    size_t size_;
+    size_t position_ = 0;
+    bool ok_ = true;
+    std::string error_;
+};
+
+/**
+ * @brief Memory-mapped .rhd recording; extracts the board digital inputs.
+ */
+class RhdFile
+{
+public:
+    /**
+     * @brief Maps the file and parses its header.
+     *
+     * @return false if the file cannot be mapped or is not an .rhd recording; error() tells why
+     */
+    bool open(const std::string &path)
+    {
+        numBlocks_ = 0;
+        trailingBytes_ = 0;
+        if (!file_.open(path))
+            return fail(file_.error());
+
+        RhdHeaderParser parser(file_.data(), file_.size());
+        if (!parser.parse(header_))
+        {
+            file_.close();
+            return fail(path + ": " + parser.error());
+        }
+        numBlocks_ = (file_.size() - header_.headerBytes) / header_.blockBytes;
+        trailingBytes_ = (file_.size() - header_.headerBytes) % header_.blockBytes;
+        return true;
+    }
+
+    const RhdHeader &header() const { return header_; }
+    const std::string &error() const { return error_; }
+    size_t numBlocks() const { return numBlocks_; }
+    size_t numSamples() const { return numBlocks_ * size_t(header_.samplesPerBlock); }
+
+    /**
+     * @return size_t bytes after the last complete block, e.g. of a recording that was cut off
+     */
+    size_t trailingBytes() const { return trailingBytes_; }
+
+    /**
+     * @return int32_t Intan timestamp (sample number on the board) of the first sample; 0 without data blocks
+     */
+    int32_t firstTimestamp() const
+    {
+        int32_t timestamp = 0;
+        if (numBlocks_ > 0)
+            std::memcpy(&timestamp, file_.data() + header_.headerBytes, sizeof(timestamp));
+        return timestamp;
+    }
+
+    /**
+     * @brief Copies the digital-in words of a range of samples, touching only those bytes of the blocks.
+     *
+     * @param first first sample
+     * @param count number of samples; first + count must not exceed numSamples()
+     * @param words set to one word per sample, bit n is DIN n; all 0 without enabled digital inputs
+     */
+    void readDigitalIn(size_t first, size_t count, uint16_t *words) const
+    {
+        if (header_.numDigitalIn == 0)
+        {
+            std::memset(words, 0, count * sizeof(uint16_t));
+            return;
+        }
+        const size_t samplesPerBlock = size_t(header_.samplesPerBlock);
+        size_t block = first / samplesPerBlock;
+        size_t offset = first % samplesPerBlock;
+        const uint8_t *run = file_.data() + header_.headerBytes + block * header_.blockBytes + header_.digitalInOffset;
+        for (size_t done = 0; done < count; block++, run += header_.blockBytes, offset = 0)
+        {
+            // The runs are one block apart, too far for the hardware prefetcher to follow
+            if (block + RHD_PREFETCH_BLOCKS < numBlocks_)
+            {
+                const uint8_t *ahead = run + RHD_PREFETCH_BLOCKS * header_.blockBytes;
+                for (size_t line = 0; line < 2 * samplesPerBlock; line += RHD_PREFETCH_STRIDE)
+                    __builtin_prefetch(ahead + line);
+                __builtin_prefetch(ahead + 2 * samplesPerBlock - 1);
+            }
+            size_t n = std::min(samplesPerBlock - offset, count - done);
+            std::memcpy(words + done, run + 2 * offset, 2 * n);
+            done += n;
+        }
+    }
+
+    /**
+     * @brief Copies the digital-in words of all blocks into one contiguous array.
+     *
+     * @return std::vector<uint16_t> one word per sample, bit n is DIN n; empty without enabled digital inputs
+     */
+    std::vector<uint16_t> digitalInWords() const
+    {
+        std::vector<uint16_t> words;
+        if (header_.numDigitalIn == 0)
+            return words;
+        words.resize(numSamples());
+        readDigitalIn(0, words.size(), words.data());
+        return words;
+    }
+
+    /**
+     * @brief Extracts the digital inputs as one bit plane per line, ready for the batch decoder.
+     *
+     * @return std::vector<BitPlane> RHD_DIGITAL_IN_LINES planes (DIN 0 first); empty without enabled digital inputs
+     */
+    std::vector<BitPlane> digitalInPlanes() const
+    {
+        std::vector<uint16_t> words = digitalInWords();
+        if (words.empty())
+            return std::vector<BitPlane>();
+        return transposeToBitPlanes(reinterpret_cast<const uint8_t *>(words.data()), words.size(), 2,
+                                    RHD_DIGITAL_IN_LINES);
+    }
+
+private:
+    bool fail(const std::string &error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    MappedFile file_;
+    RhdHeader header_;
+    size_t numBlocks_ = 0;
+    size_t trailingBytes_ = 0;
+    std::string error_;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+/**
+ * Sample-by-sample verification of a bitcode read back on the loopback line.
+ *
+ * Instead of decoding the readback (one sample per digit) and comparing timestamps, every sample read is compared with
+ * the sample written, 16 at a time with SSE2. This is cheaper than the decode and also catches errors away from the
+ * middle of the digits, such as slow edges or skew, which the decode cannot see.
+ */
+
+#include <cstdint>
+#include <ostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bitcode_format.cpp"
+
+constexpr int LOOPBACK_MASK_WORDS = (MAX_BITCODE_LENGTH + 63) / 64; // Words of a wrong-sample mask of any bitcode
+
+/**
+ * @brief Wrong samples of one loopback; first and last are -1 if there are none.
+ */
+struct LoopbackMismatch
+{
+    int count = 0;
+    int first = -1; // Sample of the bitcode
+    int last = -1;
+};
+
+/**
+ * @brief Compares the samples read back with the samples written; any non-zero sample is HIGH.
+ *
+ * @param written samples written
+ * @param read samples read, aligned with written (the readback of the sender starts 1 sample later)
+ * @param length number of samples
+ * @param wrongSamples if not NULL, bit i % 64 of word i / 64 is set if sample i is wrong; (length + 63) / 64 words
+ * @return LoopbackMismatch
+ */
+inline LoopbackMismatch compareLoopback(const uint8_t *written, const uint8_t *read, int length,
+                                        uint64_t *wrongSamples = NULL)
+{
+    LoopbackMismatch mismatch;
+    if (wrongSamples != NULL)
+    {
+        for (int word = 0; word < (length + 63) / 64; word++)
+            wrongSamples[word] = 0;
+    }
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16)
+    {
+        // Bit j is set if sample i + j is LOW in one array and HIGH in the other
+        __m128i lowWritten = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(written + i)), zero);
+        __m128i lowRead = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(read + i)), zero);
+        unsigned bits = unsigned(_mm_movemask_epi8(_mm_xor_si128(lowWritten, lowRead)));
+        if (bits != 0)
+        {
+            if (mismatch.count == 0)
+                mismatch.first = i + __builtin_ctz(bits);
+            mismatch.last = i + 31 - __builtin_clz(bits);
+            mismatch.count += __builtin_popcount(bits);
+            if (wrongSamples != NULL)
+                wrongSamples[i / 64] |= uint64_t(bits) << (i % 64);
+        }
+    }
+#endif
+    for (; i < length; i++)
+    {
+        if ((written[i] != 0) != (read[i] != 0))
+        {
+            if (mismatch.count == 0)
+                mismatch.first = i;
+            mismatch.last = i;
+            mismatch.count++;
+            if (wrongSamples != NULL)
+                wrongSamples[i / 64] |= uint64_t(1) << (i % 64);
+        }
+    }
+    return mismatch;
+}
+
+/**
+ * @brief Prints the number of wrong samples and the first and last of them, with their digit and offset in the digit.
+ */
+inline std::ostream &operator<<(std::ostream &out, const LoopbackMismatch &mismatch)
+{
+    out << mismatch.count << " wrong samples";
+    if (mismatch.count == 0)
+        return out;
+    out << ", first at sample " << mismatch.first << " (digit " << mismatch.first / DIGIT_REPEATS << " + "
+        << mismatch.first % DIGIT_REPEATS << "), last at sample " << mismatch.last << " (digit "
+        << mismatch.last / DIGIT_REPEATS << " + " << mismatch.last % DIGIT_REPEATS << ")";
+    return out;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Read-only memory mapping of a whole file, for readers of recordings that touch only a small part of it.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /**
+     * @brief Maps a file, hinting the kernel that it is read front to back.
+     *
+     * @return false if the file cannot be opened, is empty or cannot be mapped; error() tells why
+     */
+    bool open(const std::string &path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return fail("cannot open " + path);
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size == 0)
+        {
+            ::close(fd);
+            return fail("cannot read " + path);
+        }
+        void *mapped = mmap(NULL, size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return fail("cannot map " + path);
+        madvise(mapped, size_t(status.st_size), MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t *>(mapped);
+        size_ = size_t(status.st_size);
+        return true;
+    }
+
+    void close()
+    {
+        if (data_ != NULL)
+            munmap(const_cast<uint8_t *>(data_), size_);
+        data_ = NULL;
+        size_ = 0;
+    }
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string &error() const { return error_; }
+
+private:
+    bool fail(const std::string &error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    const uint8_t *data_ = NULL;
+    size_t size_ = 0;
+    std::string error_;
+};
@@ -0,0 +1,35 @@
+/**
+ * This file demonstrates the use of a NIDAQ board to stream dual-rate sync codes for a fixed duration.
+ *
+ * A DualRateSync streams a 16-bit sequence number every 10 ms on one line and the full CPU timestamp every second on
+ * another line, both from the same hardware sample clock. fuse_dual_rate.cpp turns a recording of the two lines into a
+ * timeline with an absolute time every 10 ms.
+ *
+ * In our setup, we are using a NI PCIe-6321 board.
+ * Channels Dev2/port0/line1 (sequence) and Dev2/port0/line4 (timestamp) are connected to two digital inputs of the
+ * Intan board.
+ */
+
+#include <NIDAQmx.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "dual_rate_sync.cpp"
+
+int main()
+{
+    // Set fec to append Hamming check digits to the timestamp frames
+    DualRateSyncConfig config;
+    config.fec = false;
+
+    DualRateSync sync(config);
+    sync.start();
+    std::cout << "Streaming dual-rate sync codes for 60 s" << std::endl;
+
+    std::this_thread::sleep_for(std::chrono::seconds(60));
+
+    sync.stop();
+    return 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+constexpr int LATENCY_BUCKETS = 32; // Power-of-two buckets of microseconds; the last one also holds all longer ones
+
+/**
+ * @brief Distribution of send latencies in constant memory, so it can be updated on the sender thread without
+ * allocating.
+ *
+ * Besides count, mean and max, latencies are counted in power-of-two buckets, from which percentiles are estimated to
+ * within a factor of two.
+ */
+struct SendLatencyHistogram
+{
+    uint64_t count = 0;
+    uint64_t sumUS = 0;
+    uint64_t maxUS = 0;
+    uint64_t buckets[LATENCY_BUCKETS] = {}; // Bucket b > 0 holds latencies in [2^(b-1), 2^b) us; bucket 0 holds 0 us
+
+    void add(uint64_t us)
+    {
+        count++;
+        sumUS += us;
+        maxUS = std::max(maxUS, us);
+        int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        buckets[std::min(bucket, LATENCY_BUCKETS - 1)]++;
+    }
+
+    double meanUS() const { return count == 0 ? 0.0 : double(sumUS) / double(count); }
+
+    /**
+     * @brief Estimates a percentile as the upper bound of the bucket that holds it.
+     *
+     * @param p fraction of latencies at or below the result, e.g. 0.99
+     * @return uint64_t latency (us), at most maxUS
+     */
+    uint64_t percentileUS(double p) const
+    {
+        uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p * double(count))));
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            cumulative += buckets[b];
+            if (cumulative >= rank)
+                return std::min(maxUS, (uint64_t(1) << b) - 1);
+        }
+        return maxUS;
+    }
+};
@@ -1,7 +1,8 @@
 /**
  * This file demonstrates the use of a NIDAQ board to send a hardware-timed bitcode that corresponds to a timestamp.
  *
- * The main thread obtains new timestamps, and a separate thread controls the NIDAQ board and sends the bitcode pulses.
+ * The main thread marks events with the software HIGH (BitcodeSender::markNow), and a BitcodeSender with its own
+ * thread controls the NIDAQ board and sends the bitcode pulses carrying their timestamps.
  *
  * In our setup, we are using a NI PCIe-6321 board.
  * Channels Dev2/port0/line0 and Dev2/port0/line1 are physically connected.
@@ -10,7 +11,6 @@
 
 #include <NIDAQmx.h>
 
-#include <atomic>
 #include <iostream>
 #include <thread>
 
@@ -18,27 +18,53 @@
 
 int main()
 {
-
-    std::atomic<bool> keepSendingBitcodeFlag(true);
-    std::atomic<bool> *keepSendingBitcodeFlag_ptr = &keepSendingBitcodeFlag;
+    // Use BitcodeMode::CounterOutput to generate the bitcode on ctr1 (PFI13) instead of line1, set fec to append
+    // Hamming check digits that correct single flipped digits, and set hardwareMarker to emit the timing marker on
+    // line3 from the same hardware-timed DO task as the bitcode. Set perfCounters to report cycles, instructions, cache
+    // misses, context switches and page faults per stage of a send. Set numSources to let several producers share the
+    // line; each bitcode then carries its source as a tag. Set preemption to let urgent timestamps (see PriorityClass)
+    // abort a bitcode in flight, reportLatency to print the latency of each priority class, and trackBitErrors to
+    // measure the bit error rate and timing margins of the loopback. Set adaptive to let the sender switch to short
+    // codes, sampled verification and event wakeup as the load changes (see SyncModeController), and completions to
+    // get the emission time and verify result of every timestamp back (see pollCompletion). A second sender with its
+    // own lines (and name) can run alongside this one.
+    BitcodeSenderConfig config;
+    config.mode = BitcodeMode::DigitalOutput;
+    config.fec = false;
+    config.hardwareMarker = false;
+    config.perfCounters = false;
 
     // Create bitcode thread
-    std::thread bitcodeThread(bitcodeSender, keepSendingBitcodeFlag_ptr);
+    BitcodeSender sender(config);
+    sender.start();
 
     // Sleep to allow thread to start
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
-    for (int i = 0; i < 1; i++)
+    for (int i = 0; i < 10; i++)
     {
-        // Get timestamp
-        tsInAtomic = getCPUClockTimeUS(); // atomic variable
-        std::cout << "Timestamp: " << tsInAtomic << std::endl;
+        // Mark the event on this thread; queue a timestamp instead while the previous bitcode is still in flight
+        uint64_t tsIn = sender.markNow();
+        if (tsIn == 0)
+        {
+            tsIn = getCPUClockTimeUS();
+            sender.send(tsIn);
+        }
+        std::cout << "Timestamp: " << tsIn << std::endl;
 
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
-    *keepSendingBitcodeFlag_ptr = false;
-    bitcodeThread.join();
+    sender.stop();
+
+#ifdef BITCODE_GUARD
+    // Fail when the hot path allocated or entered the kernel after warm-up
+    if (hotPathViolations != 0)
+    {
+        std::cout << "Hot path guard: " << hotPathViolations << " violations" << std::endl;
+        return 1;
+    }
+#endif
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "send_latency_histogram.cpp"
+
+constexpr int CONTROL_WINDOW_FRAMES = 32; // Frames between decisions of the mode controller
+constexpr int FULL_CODE_INTERVAL = 16;    // With short codes, every n-th bitcode is still a full one
+
+/**
+ * @brief Runtime modes of a BitcodeSender, switched between frames by a SyncModeController.
+ */
+struct SyncMode
+{
+    bool shortCodes = false;  // Send only the low SHORT_TIMESTAMP_BITS bits of most timestamps
+    int verifyEvery = 1;      // Decode and compare the loopback of every n-th bitcode only
+    bool eventWakeup = false; // Sleep until a timestamp is queued instead of polling the queues
+
+    bool operator==(const SyncMode &other) const
+    {
+        return shortCodes == other.shortCodes && verifyEvery == other.verifyEvery && eventWakeup == other.eventWakeup;
+    }
+    bool operator!=(const SyncMode &other) const { return !(*this == other); }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const SyncMode &mode)
+{
+    return out << (mode.shortCodes ? "short codes" : "full codes") << ", verify every " << mode.verifyEvery << ", "
+               << (mode.eventWakeup ? "event wakeup" : "polling");
+}
+
+/**
+ * @brief Targets and allowed modes of a SyncModeController.
+ */
+struct SyncModeControllerConfig
+{
+    bool allowShortCodes = true;
+    bool allowSampledVerify = true;
+    bool allowEventWakeup = true;
+    int sampledVerifyEvery = 8;       // verifyEvery while overloaded (at least 1)
+    size_t maxQueueDepth = 4;         // Queued timestamps at which the sender counts as overloaded
+    uint64_t latencyTargetUS = 80000; // p99 latency from send() to the start of the bitcode
+    double maxDigitErrorRate = 1e-4;  // Rolling digit error rate above which full codes are sent and all verified
+    uint64_t idleIntervalUS = 50000;  // Mean time between bitcodes above which the sender waits for events
+};
+
+/**
+ * @brief Adapts the mode of a BitcodeSender to the observed load, so it holds its sync rate without manual tuning.
+ *
+ * The sender reports every bitcode (queue depth, latency, rolling digit error rate), and the controller decides once
+ * per CONTROL_WINDOW_FRAMES bitcodes, between frames:
+ * - when the queue backs up or the p99 latency exceeds the target, short codes (about half as long) and sampled
+ *   verification raise the rate; once the queue stays short and the latency is well below the target, full codes and
+ *   verification of every bitcode return;
+ * - when the digit error rate is too high, full codes are sent and every bitcode is verified, regardless of load;
+ * - when bitcodes are rare, the sender waits for events instead of polling, freeing its core; it polls again when
+ *   they become frequent.
+ * The thresholds have hysteresis so the mode does not flap, and every switch is logged with the metrics behind it.
+ */
+class SyncModeController
+{
+public:
+    SyncModeController(std::string name, SyncModeControllerConfig config)
+        : name_(std::move(name)), config_(config)
+    {
+        // The sender verifies bitcode n when n % verifyEvery == 0
+        config_.sampledVerifyEvery = std::max(config_.sampledVerifyEvery, 1);
+    }
+
+    const SyncMode &mode() const { return mode_; }
+
+    /**
+     * @brief Records one bitcode and, at the end of a window, decides the mode for the following bitcodes.
+     *
+     * @param queueDepth timestamps still queued after this one was taken
+     * @param latencyUS time from send() to the start of this bitcode
+     * @param startUS start of this bitcode (CPU clock)
+     * @param digitErrorRate rolling digit error rate of the line, or 0 if not tracked
+     * @return true if the mode changed
+     */
+    bool update(size_t queueDepth, uint64_t latencyUS, uint64_t startUS, double digitErrorRate)
+    {
+        if (window_.count == 0)
+        {
+            windowStartUS_ = startUS;
+            windowMaxQueueDepth_ = 0;
+        }
+        window_.add(latencyUS);
+        windowMaxQueueDepth_ = queueDepth > windowMaxQueueDepth_ ? queueDepth : windowMaxQueueDepth_;
+        if (window_.count < CONTROL_WINDOW_FRAMES)
+            return false;
+
+        uint64_t p99 = window_.percentileUS(0.99);
+        uint64_t meanIntervalUS = (startUS - windowStartUS_) / (CONTROL_WINDOW_FRAMES - 1);
+        bool overloaded = windowMaxQueueDepth_ >= config_.maxQueueDepth || p99 > config_.latencyTargetUS;
+        bool relaxed = windowMaxQueueDepth_ <= 1 && p99 < config_.latencyTargetUS / 2;
+        bool noisy = digitErrorRate > config_.maxDigitErrorRate;
+
+        SyncMode next = mode_;
+        if (noisy)
+        {
+            next.shortCodes = false;
+            next.verifyEvery = 1;
+        }
+        else if (overloaded)
+        {
+            next.shortCodes = config_.allowShortCodes;
+            next.verifyEvery = config_.allowSampledVerify ? config_.sampledVerifyEvery : 1;
+        }
+        else if (relaxed)
+        {
+            next.shortCodes = false;
+            next.verifyEvery = 1;
+        }
+        if (meanIntervalUS > config_.idleIntervalUS)
+            next.eventWakeup = config_.allowEventWakeup;
+        else if (meanIntervalUS < config_.idleIntervalUS / 2)
+            next.eventWakeup = false;
+
+        bool changed = next != mode_;
+        if (changed)
+        {
+            std::cout << name_ << ": " << mode_ << " -> " << next << " (queue depth " << windowMaxQueueDepth_
+                      << ", p99 " << p99 << " us, interval " << meanIntervalUS << " us, digit error rate "
+                      << digitErrorRate << ")" << std::endl;
+            mode_ = next;
+        }
+        window_ = SendLatencyHistogram();
+        return changed;
+    }
+
+private:
+    std::string name_;
+    SyncModeControllerConfig config_;
+    SyncMode mode_;
+    SendLatencyHistogram window_; // Latencies of the current window
+    uint64_t windowStartUS_ = 0;
+    size_t windowMaxQueueDepth_ = 0;
+};
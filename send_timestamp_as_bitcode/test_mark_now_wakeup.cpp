@@ -0,0 +1,107 @@
+/**
+ * This file checks that markNow() wakes a BitcodeSender that sleeps between bitcodes in event wakeup mode, so the
+ * bitcode of a mark starts right after it instead of after the WAKEUP_TIMEOUT_US poll.
+ *
+ * An adaptive sender is first brought into event wakeup mode by a slow run of timestamps. It is then left idle before
+ * each mark, and the delay from the mark to the start of its bitcode (queueDelayUS of its completion) is collected.
+ * The test fails if the median delay is not well below WAKEUP_TIMEOUT_US.
+ *
+ * It runs on the lines of the default BitcodeSenderConfig; a simulated device works, since only the timing is checked.
+ *
+ * Usage: ./test_mark_now_wakeup; returns 0 on success
+ */
+
+#include <NIDAQmx.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bitcode.cpp"
+
+constexpr int WARMUP_TIMESTAMPS = CONTROL_WINDOW_FRAMES; // One controller window, to switch to event wakeup
+constexpr int NUM_MARKS = CONTROL_WINDOW_FRAMES / 2;     // Fewer than a window, so the mode does not change again
+constexpr int IDLE_MS = 20;                              // Idle time before each mark; the sender is asleep by then
+
+/**
+ * @brief Waits for the next completion of source 0.
+ *
+ * @return false if none arrives within a second
+ */
+bool waitForCompletion(BitcodeSender &sender, SendCompletion &completion)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!sender.pollCompletion(completion))
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    return true;
+}
+
+int main()
+{
+    BitcodeSenderConfig config;
+    config.adaptive = true;
+    config.control.idleIntervalUS = 1000; // Bitcodes of the warm-up are further apart, so the sender waits for events
+    config.completions = true;
+
+    BitcodeSender sender(config);
+    sender.start();
+
+    SendCompletion completion;
+    for (int i = 0; i < WARMUP_TIMESTAMPS; i++)
+    {
+        sender.send(getCPUClockTimeUS());
+        if (!waitForCompletion(sender, completion))
+        {
+            std::cerr << "Timestamp " << i << " of the warm-up was not sent" << std::endl;
+            sender.stop();
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    std::vector<uint64_t> delaysUS;
+    for (int i = 0; i < NUM_MARKS; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+        if (sender.markNow() == 0)
+        {
+            std::cerr << "Mark " << i << " found the software line busy" << std::endl;
+            continue;
+        }
+        if (!waitForCompletion(sender, completion))
+        {
+            std::cerr << "The bitcode of mark " << i << " was not sent" << std::endl;
+            sender.stop();
+            return 1;
+        }
+        delaysUS.push_back(completion.queueDelayUS);
+    }
+    sender.stop();
+
+    if (!sender.mode().eventWakeup)
+    {
+        std::cerr << "The sender did not switch to event wakeup; the test did not run" << std::endl;
+        return 1;
+    }
+    if (delaysUS.empty())
+    {
+        std::cerr << "No mark was sent" << std::endl;
+        return 1;
+    }
+    std::sort(delaysUS.begin(), delaysUS.end());
+    uint64_t medianUS = delaysUS[delaysUS.size() / 2];
+    std::cout << delaysUS.size() << " marks, delay to the bitcode: median " << medianUS << " us, max "
+              << delaysUS.back() << " us (wakeup timeout " << WAKEUP_TIMEOUT_US << " us)" << std::endl;
+    if (medianUS >= uint64_t(WAKEUP_TIMEOUT_US / 4))
+    {
+        std::cerr << "The bitcode of a mark waits for the wakeup timeout" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+/**
+ * Format of the AO stream that stimuli are rendered into, shared by the sequencer and the calibration benchmark.
+ */
+
+constexpr double AO_SAMPLE_RATE = 44000; // Hz; sample rate of the AO stream
+constexpr int AO_BLOCK_LENGTH = 2200;    // Samples rendered per refill (50 ms)
+constexpr int AO_BUFFER_BLOCKS = 4;      // Blocks held in the device buffer; bounds latency and underflow margin
+constexpr double AO_MAX_VOLTAGE = 10.0;  // V; range of the AO channel
@@ -0,0 +1,60 @@
+/**
+ * This file benchmarks the calibration stage of the AO waveform pipeline.
+ *
+ * The FIR equalizer runs inside the refill loop of playSequence, so filtering one block must take a small fraction
+ * of the block's playback time (AO_BLOCK_LENGTH / AO_SAMPLE_RATE) to avoid underflows. For a range of filter lengths,
+ * this prints the time per block and that fraction.
+ *
+ * Does not require a NI-DAQ board.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "ao_stream.cpp"
+#include "calibration.cpp"
+
+constexpr int NUM_BLOCKS = 2000; // Blocks filtered per measurement
+
+int main()
+{
+    const double blockSeconds = AO_BLOCK_LENGTH / AO_SAMPLE_RATE;
+
+    // Gain lookup, once per tone per block
+    CalibrationTable table({{250, 1.5}, {500, 0.0}, {1000, -0.8}, {2000, -2.1}, {4000, 0.7}, {8000, 3.2}});
+    volatile double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1000000; i++)
+    {
+        sink = sink + table.gainAt(300 + (i % 7000));
+    }
+    std::chrono::duration<double> gainTime = std::chrono::steady_clock::now() - start;
+    std::cout << "gainAt: " << gainTime.count() * 1e9 / 1000000 << " ns/lookup" << std::endl;
+
+    // FIR equalizer
+    std::vector<double> block(AO_BLOCK_LENGTH);
+    for (int numTaps : {16, 32, 64, 128, 256, 512})
+    {
+        std::vector<double> taps(numTaps, 1.0 / numTaps);
+        FirEqualizer equalizer(taps, AO_BLOCK_LENGTH);
+
+        for (int i = 0; i < AO_BLOCK_LENGTH; i++)
+        {
+            block[i] = (i % 100) / 100.0;
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < NUM_BLOCKS; i++)
+        {
+            equalizer.process(block.data(), AO_BLOCK_LENGTH);
+        }
+        std::chrono::duration<double> firTime = std::chrono::steady_clock::now() - start;
+
+        double perBlock = firTime.count() / NUM_BLOCKS;
+        std::cout << numTaps << " taps: " << perBlock * 1e6 << " us/block, " << 100 * perBlock / blockSeconds
+                  << "% of block duration" << std::endl;
+    }
+
+    return 0;
+}
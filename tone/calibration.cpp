@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Per-frequency gain correction of the speaker.
+ *
+ * Gains are interpolated linearly in dB over log frequency between the measured points, and held constant beyond the
+ * first/last point.
+ */
+class CalibrationTable
+{
+public:
+    struct Point
+    {
+        double frequency; // Hz
+        double gainDb;    // dB; correction applied to the requested amplitude
+    };
+
+    CalibrationTable() = default;
+
+    explicit CalibrationTable(std::vector<Point> points) : points_(std::move(points))
+    {
+        std::sort(points_.begin(), points_.end(), [](const Point &a, const Point &b) { return a.frequency < b.frequency; });
+    }
+
+    /**
+     * @brief Loads a table from a CSV file with one "frequency,gain_db" pair per line.
+     *
+     * Lines that do not start with a number (e.g. a header) are skipped.
+     *
+     * @param path path to the CSV file
+     * @return CalibrationTable
+     */
+    static CalibrationTable load(const std::string &path)
+    {
+        std::vector<Point> points;
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::replace(line.begin(), line.end(), ',', ' ');
+            std::istringstream fields(line);
+            Point point;
+            if (fields >> point.frequency >> point.gainDb)
+            {
+                points.push_back(point);
+            }
+        }
+        return CalibrationTable(std::move(points));
+    }
+
+    /**
+     * @brief Linear gain at a frequency; 1 if the table is empty.
+     *
+     * @param frequency Hz
+     * @return double
+     */
+    double gainAt(double frequency) const
+    {
+        if (points_.empty())
+            return 1.0;
+        if (frequency <= points_.front().frequency)
+            return dbToLinear(points_.front().gainDb);
+        if (frequency >= points_.back().frequency)
+            return dbToLinear(points_.back().gainDb);
+
+        auto upper = std::upper_bound(points_.begin(), points_.end(), frequency,
+                                      [](double f, const Point &p) { return f < p.frequency; });
+        auto lower = upper - 1;
+        double t = std::log(frequency / lower->frequency) / std::log(upper->frequency / lower->frequency);
+        return dbToLinear(lower->gainDb + t * (upper->gainDb - lower->gainDb));
+    }
+
+    bool empty() const { return points_.empty(); }
+
+private:
+    static double dbToLinear(double db) { return std::pow(10.0, db / 20.0); }
+
+    std::vector<Point> points_;
+};
+
+/**
+ * @brief FIR equalizer that filters AO blocks in place, carrying its history across blocks.
+ *
+ * The inner loop computes several outputs at once with AVX (4 doubles) or SSE2 (2 doubles) when available. A
+ * linear-phase filter with N taps delays the stream by (N - 1) / 2 samples; stimulus offsets shift by that constant.
+ */
+class FirEqualizer
+{
+public:
+    /**
+     * @param taps filter coefficients h[0..N-1]; no taps pass blocks through unchanged, like the single tap {1}
+     * @param maxBlockLength largest block passed to process(); the work buffer is allocated once here
+     */
+    FirEqualizer(const std::vector<double> &taps, int maxBlockLength)
+        : reversedTaps_(taps.rbegin(), taps.rend()),
+          maxBlockLength_(maxBlockLength)
+    {
+        if (reversedTaps_.empty())
+            reversedTaps_.push_back(1.0);
+        work_.assign(reversedTaps_.size() - 1 + maxBlockLength, 0.0);
+    }
+
+    /**
+     * @brief Filters a block in place.
+     *
+     * @param block samples to filter
+     * @param length number of samples; at most maxBlockLength
+     */
+    void process(double *block, int length)
+    {
+        const int numTaps = int(reversedTaps_.size());
+        const int history = numTaps - 1;
+        length = std::min(length, maxBlockLength_);
+
+        // work_ holds the last `history` input samples followed by the new block
+        std::copy(block, block + length, work_.begin() + history);
+        const double *w = work_.data();
+        const double *h = reversedTaps_.data();
+
+        int n = 0;
+#if defined(__AVX__)
+        for (; n + 4 <= length; n += 4)
+        {
+            __m256d acc = _mm256_setzero_pd();
+            for (int j = 0; j < numTaps; j++)
+            {
+                acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_set1_pd(h[j]), _mm256_loadu_pd(w + n + j)));
+            }
+            _mm256_storeu_pd(block + n, acc);
+        }
+#elif defined(__SSE2__)
+        for (; n + 2 <= length; n += 2)
+        {
+            __m128d acc = _mm_setzero_pd();
+            for (int j = 0; j < numTaps; j++)
+            {
+                acc = _mm_add_pd(acc, _mm_mul_pd(_mm_set1_pd(h[j]), _mm_loadu_pd(w + n + j)));
+            }
+            _mm_storeu_pd(block + n, acc);
+        }
+#endif
+        for (; n < length; n++)
+        {
+            double acc = 0;
+            for (int j = 0; j < numTaps; j++)
+            {
+                acc += h[j] * w[n + j];
+            }
+            block[n] = acc;
+        }
+
+        // Keep the last `history` inputs for the next block
+        std::copy(work_.begin() + length, work_.begin() + length + history, work_.begin());
+    }
+
+    int numTaps() const { return int(reversedTaps_.size()); }
+
+private:
+    std::vector<double> reversedTaps_;
+    std::vector<double> work_;
+    int maxBlockLength_;
+};
@@ -0,0 +1,55 @@
+/**
+ * This file demonstrates the use of a NIDAQ board to play a long sequence of stimuli on a single AO stream.
+ *
+ * The sequence is rendered just in time by a StimulusSequencer, so thousands of short stimuli play with
+ * sample-accurate timing and without starting/stopping a task per stimulus.
+ *
+ * In our setup, we are using a NI PCIe-6321 board; the speaker amplifier is connected to Dev2/ao0.
+ */
+
+#include <NIDAQmx.h>
+
+#include <iostream>
+#include <vector>
+
+#include "sequencer.cpp"
+
+int main()
+{
+    const uint64_t toneSamples = uint64_t(0.02 * AO_SAMPLE_RATE);   // 20 ms tones
+    const uint64_t toneSpacing = uint64_t(0.05 * AO_SAMPLE_RATE);   // one tone every 50 ms
+    const uint64_t edgeSamples = uint64_t(0.002 * AO_SAMPLE_RATE);  // 2 ms onset/offset ramps
+
+    std::vector<Stimulus> timeline;
+
+    // 1000 tones alternating between 400 Hz and 800 Hz
+    for (uint64_t i = 0; i < 1000; i++)
+    {
+        Stimulus tone = {StimulusType::Tone, i * toneSpacing, toneSamples};
+        tone.frequency = (i % 2 == 0) ? 400 : 800;
+        tone.amplitude = 2.5;
+        tone.edgeSamples = edgeSamples;
+        timeline.push_back(tone);
+    }
+
+    // Followed by a noise burst and a ramp back down from 1 V
+    uint64_t end = 1000 * toneSpacing;
+    Stimulus burst = {StimulusType::Noise, end, uint64_t(0.1 * AO_SAMPLE_RATE)};
+    burst.amplitude = 1.0;
+    timeline.push_back(burst);
+
+    Stimulus ramp = {StimulusType::Ramp, end + burst.numSamples, uint64_t(0.5 * AO_SAMPLE_RATE)};
+    ramp.amplitude = 1.0;
+    ramp.endAmplitude = 0.0;
+    timeline.push_back(ramp);
+
+    StimulusSequencer sequencer(timeline);
+
+    // Sample perf counters around the render and write of every refill, to check that rendering leaves the refill
+    // loop enough headroom
+    StageMetrics metrics("sequencer");
+    playSequence("Dev2/ao0", sequencer, &metrics);
+    metrics.report(std::cout);
+
+    return 0;
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <NIDAQmx.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../common/perf_counters.cpp"
+#include "ao_stream.cpp"
+#include "calibration.cpp"
+
+/**
+ * @brief Handles error from NI-DAQmx functions.
+ *
+ * @param err NI-DAQmx error code.
+ */
+inline void handleError(int err)
+{
+    if (err == 0)
+        return;
+
+    char error[1024];
+    DAQmxGetErrorString(err, error, 1024);
+    std::cout << error << std::endl;
+}
+
+enum class StimulusType
+{
+    Tone,    // Sine wave with cosine onset/offset ramps
+    Ramp,    // Linear voltage ramp from amplitude to endAmplitude
+    Silence, // Nothing; reserves time in the timeline
+    Noise    // Uniform white noise
+};
+
+/**
+ * @brief A stimulus placed on the timeline of a StimulusSequencer.
+ *
+ * Overlapping stimuli are summed.
+ */
+struct Stimulus
+{
+    StimulusType type;
+    uint64_t startSample;      // Offset from the start of the AO stream
+    uint64_t numSamples;       // Duration
+    float64 frequency = 0;     // Hz; Tone only
+    float64 amplitude = 0;     // V; peak for Tone and Noise, start voltage for Ramp
+    float64 endAmplitude = 0;  // V; Ramp only
+    uint64_t edgeSamples = 0;  // Length of the onset/offset ramps of a Tone; avoids clicks
+};
+
+/**
+ * @brief Renders a timeline of stimuli block by block into one continuous AO stream.
+ *
+ * Memory use is bounded by the block length and the number of simultaneously active stimuli, not by the length of
+ * the timeline, so sequences of thousands of short stimuli play without per-stimulus task start/stop.
+ */
+class StimulusSequencer
+{
+public:
+    /**
+     * @param timeline stimuli to play; sorted by startSample here
+     */
+    explicit StimulusSequencer(std::vector<Stimulus> timeline) : timeline_(std::move(timeline))
+    {
+        std::stable_sort(timeline_.begin(), timeline_.end(),
+                         [](const Stimulus &a, const Stimulus &b) { return a.startSample < b.startSample; });
+        for (const Stimulus &stimulus : timeline_)
+        {
+            endSample_ = std::max(endSample_, stimulus.startSample + stimulus.numSamples);
+        }
+        active_.reserve(16);
+    }
+
+    /**
+     * @brief Applies speaker calibration while rendering.
+     *
+     * Tone amplitudes are scaled by the gain of the table at their frequency, and the summed block is then filtered by
+     * the equalizer, if given. Both must outlive the sequencer.
+     *
+     * @param table per-frequency gain table, or NULL
+     * @param equalizer FIR equalizer for blocks of up to AO_BLOCK_LENGTH samples, or NULL
+     */
+    void setCalibration(const CalibrationTable *table, FirEqualizer *equalizer)
+    {
+        calibration_ = table;
+        equalizer_ = equalizer;
+    }
+
+    /**
+     * @brief Renders the next block of the stream.
+     *
+     * @param block array to render to
+     * @param length number of samples to render
+     */
+    void renderBlock(float64 *block, int length)
+    {
+        std::fill(block, block + length, 0.0);
+        uint64_t blockEnd = position_ + length;
+
+        // Activate stimuli that start within this block
+        while (next_ < timeline_.size() && timeline_[next_].startSample < blockEnd)
+        {
+            active_.push_back(next_++);
+        }
+
+        // Render active stimuli, then drop the ones that have finished
+        for (size_t index : active_)
+        {
+            renderStimulus(timeline_[index], block, length);
+        }
+        active_.erase(std::remove_if(active_.begin(), active_.end(),
+                                     [&](size_t index)
+                                     {
+                                         const Stimulus &s = timeline_[index];
+                                         return s.startSample + s.numSamples <= blockEnd;
+                                     }),
+                      active_.end());
+
+        if (equalizer_ != NULL)
+        {
+            equalizer_->process(block, length);
+        }
+
+        // Clip to the range of the AO channel
+        for (int i = 0; i < length; i++)
+        {
+            block[i] = std::clamp(block[i], -AO_MAX_VOLTAGE, AO_MAX_VOLTAGE);
+        }
+
+        position_ = blockEnd;
+    }
+
+    /**
+     * @return true once every stimulus has been rendered
+     */
+    bool done() const { return position_ >= endSample_; }
+
+    /**
+     * @return uint64_t number of samples rendered so far
+     */
+    uint64_t position() const { return position_; }
+
+private:
+    void renderStimulus(const Stimulus &s, float64 *block, int length) const
+    {
+        // Overlap of the stimulus with the block, in samples relative to the stimulus start
+        uint64_t first = std::max(s.startSample, position_) - s.startSample;
+        uint64_t last = std::min(s.startSample + s.numSamples, position_ + length) - s.startSample;
+        float64 *out = block + (s.startSample + first - position_);
+
+        switch (s.type)
+        {
+        case StimulusType::Tone:
+        {
+            float64 phaseStep = 2 * M_PI * s.frequency / AO_SAMPLE_RATE;
+            float64 amplitude = s.amplitude * (calibration_ != NULL ? calibration_->gainAt(s.frequency) : 1.0);
+            for (uint64_t k = first; k < last; k++)
+            {
+                out[k - first] += amplitude * edgeGain(s, k) * std::sin(phaseStep * k);
+            }
+            break;
+        }
+        case StimulusType::Ramp:
+        {
+            float64 slope = s.numSamples > 1 ? (s.endAmplitude - s.amplitude) / (s.numSamples - 1) : 0;
+            for (uint64_t k = first; k < last; k++)
+            {
+                out[k - first] += s.amplitude + slope * k;
+            }
+            break;
+        }
+        case StimulusType::Noise:
+        {
+            for (uint64_t k = first; k < last; k++)
+            {
+                out[k - first] += s.amplitude * noise(s.startSample + k);
+            }
+            break;
+        }
+        case StimulusType::Silence:
+            break;
+        }
+    }
+
+    /**
+     * @brief Raised-cosine onset/offset gain of a tone at sample k.
+     */
+    static float64 edgeGain(const Stimulus &s, uint64_t k)
+    {
+        uint64_t edge = std::min(s.edgeSamples, s.numSamples / 2);
+        if (edge == 0)
+            return 1.0;
+        uint64_t fromEdge = std::min(k, s.numSamples - 1 - k);
+        if (fromEdge >= edge)
+            return 1.0;
+        return 0.5 - 0.5 * std::cos(M_PI * fromEdge / edge);
+    }
+
+    /**
+     * @brief Uniform noise in [-1, 1) as a stateless hash of the stream sample index, so any block renders identically.
+     */
+    static float64 noise(uint64_t sample)
+    {
+        uint64_t x = sample * 0x9E3779B97F4A7C15ull;
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ull;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        return (x >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+    }
+
+    std::vector<Stimulus> timeline_;
+    std::vector<size_t> active_; // Indices into timeline_ of stimuli overlapping the current block
+    size_t next_ = 0;            // Index of the next stimulus to activate
+    uint64_t position_ = 0;      // Stream sample at the start of the next block
+    uint64_t endSample_ = 0;     // Stream sample after the last stimulus ends
+    const CalibrationTable *calibration_ = NULL;
+    FirEqualizer *equalizer_ = NULL;
+};
+
+/**
+ * @brief Plays a sequence on a continuous AO task, rendering each block just before the device needs it.
+ *
+ * Regeneration is disabled, so the device never replays stale samples; each DAQmxWriteAnalogF64 blocks until
+ * AO_BLOCK_LENGTH samples of buffer space are free. The stream ends with one block of silence so the output settles
+ * at 0 V; the task is stopped once the silence starts playing, before the buffer can underflow.
+ *
+ * @param channel AO channel, e.g. "Dev2/ao0"
+ * @param sequencer sequencer to render from
+ * @param metrics if not NULL, samples perf counters around the render and write of each refill
+ */
+void playSequence(const char *channel, StimulusSequencer &sequencer, StageMetrics *metrics = NULL)
+{
+    TaskHandle aoTask;
+    handleError(DAQmxCreateTask("sequencer", &aoTask));
+    handleError(
+        DAQmxCreateAOVoltageChan(aoTask, channel, "ao", -AO_MAX_VOLTAGE, AO_MAX_VOLTAGE, DAQmx_Val_Volts, NULL));
+    handleError(DAQmxCfgSampClkTiming(aoTask, "", AO_SAMPLE_RATE, DAQmx_Val_Rising, DAQmx_Val_ContSamps,
+                                      AO_BLOCK_LENGTH * AO_BUFFER_BLOCKS));
+    handleError(DAQmxSetWriteRegenMode(aoTask, DAQmx_Val_DoNotAllowRegen));
+    handleError(DAQmxSetBufOutputBufSize(aoTask, AO_BLOCK_LENGTH * AO_BUFFER_BLOCKS));
+
+    float64 block[AO_BLOCK_LENGTH];
+    uint64_t samplesWritten = 0;
+
+    // Pre-fill the device buffer before starting
+    for (int i = 0; i < AO_BUFFER_BLOCKS; i++)
+    {
+        sequencer.renderBlock(block, AO_BLOCK_LENGTH);
+        handleError(
+            DAQmxWriteAnalogF64(aoTask, AO_BLOCK_LENGTH, false, 10.0, DAQmx_Val_GroupByChannel, block, NULL, NULL));
+        samplesWritten += AO_BLOCK_LENGTH;
+    }
+    handleError(DAQmxStartTask(aoTask));
+
+    // Refill loop; the write blocks until a block of buffer space is free
+    bool silenceWritten = false;
+    while (!silenceWritten)
+    {
+        silenceWritten = sequencer.done();
+        {
+            PerfStageScope stage(metrics, "render");
+            sequencer.renderBlock(block, AO_BLOCK_LENGTH);
+        }
+        {
+            // Mostly time blocked in the driver waiting for buffer space; counters show whether the render competes
+            PerfStageScope stage(metrics, "write");
+            handleError(
+                DAQmxWriteAnalogF64(aoTask, AO_BLOCK_LENGTH, false, 10.0, DAQmx_Val_GroupByChannel, block, NULL, NULL));
+        }
+        samplesWritten += AO_BLOCK_LENGTH;
+    }
+
+    // Wait until the trailing silence is being generated
+    uInt64 samplesGenerated = 0;
+    while (samplesGenerated < samplesWritten - AO_BLOCK_LENGTH)
+    {
+        handleError(DAQmxGetWriteTotalSampPerChanGenerated(aoTask, &samplesGenerated));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    handleError(DAQmxStopTask(aoTask));
+    handleError(DAQmxClearTask(aoTask));
+}
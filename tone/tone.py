@@ -1,30 +1,125 @@
+import collections
+import threading
+import time
+
 import nidaqmx
 import numpy as np
-import time
 
 # Inputs
 FREQUENCY = 400  # FREQUENCY of the tone in Hz
 DURATION = 0.25  # DURATION of the tone in seconds
 SAMPLE_RATE = 44000  # Sample rate in Hz
 
-# Generate tone time array
-num_timesteps = int(SAMPLE_RATE * DURATION)
-t = np.linspace(0, DURATION, num_timesteps, endpoint=False)
-tone = np.sin(2 * np.pi * FREQUENCY * t)  # Sine wave with FREQUENCY Hz
-tone_scaled = tone * 2.5  # Scale to -2.5 to +2.5V
+
+def make_tone(frequency, duration):
+    """Generate a tone scaled to -2.5 to +2.5V."""
+    num_timesteps = int(SAMPLE_RATE * duration)
+    t = np.linspace(0, duration, num_timesteps, endpoint=False)
+    tone = np.sin(2 * np.pi * frequency * t)  # Sine wave with frequency Hz
+    return tone * 2.5  # Scale to -2.5 to +2.5V
+
+
+BLOCK_LENGTH = 2200  # Samples written per refill (50 ms)
+BUFFER_BLOCKS = 4  # Blocks held in the device buffer; bounds the latency of a tone queued while idle
+
+
+class TonePlayer:
+    """Plays queued tones on one continuous AO stream, so the gaps between them are sample-accurate.
+
+    The task runs from play() to close() without regeneration. A refill thread writes one block at a time as buffer
+    space frees up, taking the next samples of the queued tones and their gaps, or silence while nothing is queued.
+    Consecutive queued tones are therefore separated by exactly their gap, whether they were queued before play() or
+    during playback, as long as the next tone is queued before the previous one and its gap have been written. A tone
+    queued while the stream plays silence starts on the next block written, up to BUFFER_BLOCKS blocks later.
+    """
+
+    def __init__(self, channel="Dev2/ao0"):
+        self._lock = threading.Lock()
+        self._pending = collections.deque()  # Tones (arrays) and gaps (sample counts) not yet written
+        self._offset = 0  # Samples of the first pending item already written
+        self._written = 0  # Samples written to the stream
+        self._end_sample = 0  # Stream sample after the last queued tone and its gap
+        self._running = False
+        self._thread = None
+
+        self._task = nidaqmx.Task()
+        self._task.ao_channels.add_ao_voltage_chan(channel)
+        self._task.timing.cfg_samp_clk_timing(
+            SAMPLE_RATE,
+            sample_mode=nidaqmx.constants.AcquisitionType.CONTINUOUS,
+            samps_per_chan=BLOCK_LENGTH * BUFFER_BLOCKS,
+        )  # Hardware-timed
+        self._task.out_stream.regen_mode = nidaqmx.constants.RegenerationMode.DONT_ALLOW_REGENERATION
+        self._task.out_stream.output_buf_size = BLOCK_LENGTH * BUFFER_BLOCKS
+
+    def queue(self, tone, gap=0.0):
+        """Queue a tone, followed by gap seconds of silence before the next tone."""
+        with self._lock:
+            self._pending.append(np.asarray(tone, dtype=np.float64))
+            self._pending.append(int(round(gap * SAMPLE_RATE)))
+            self._end_sample = max(self._end_sample, self._written) + len(tone) + int(round(gap * SAMPLE_RATE))
+
+    def play(self):
+        """Start the stream; queued tones play in order, and tones queued later follow on the same stream."""
+        if self._running:
+            return
+        for _ in range(BUFFER_BLOCKS):
+            self._task.write(self._render_block(), auto_start=False)
+        self._task.start()
+        self._running = True
+        self._thread = threading.Thread(target=self._refill, daemon=True)
+        self._thread.start()
+
+    def wait(self, timeout=None):
+        """Block until all queued tones have been generated; returns False on timeout."""
+        if not self._running:
+            return True
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while self._task.out_stream.total_samp_per_chan_generated < self._end_sample:
+            if deadline is not None and time.monotonic() > deadline:
+                return False
+            time.sleep(0.001)
+        return True
+
+    def close(self):
+        if self._running:
+            self.wait()
+            self._running = False
+            self._thread.join()
+            self._task.stop()
+        self._task.close()
+
+    def _render_block(self):
+        # Next BLOCK_LENGTH samples of the queued tones and gaps, silence after them
+        block = np.zeros(BLOCK_LENGTH)
+        filled = 0
+        with self._lock:
+            while filled < BLOCK_LENGTH and self._pending:
+                item = self._pending[0]
+                length = item if isinstance(item, int) else len(item)
+                n = min(length - self._offset, BLOCK_LENGTH - filled)
+                if not isinstance(item, int):
+                    block[filled : filled + n] = item[self._offset : self._offset + n]
+                filled += n
+                self._offset += n
+                if self._offset == length:
+                    self._pending.popleft()
+                    self._offset = 0
+            self._written += BLOCK_LENGTH
+        return block
+
+    def _refill(self):
+        # Each write blocks until a block of buffer space is free
+        while self._running:
+            self._task.write(self._render_block(), auto_start=False, timeout=10.0)
 
 
-with nidaqmx.Task() as task:
-    task.ao_channels.add_ao_voltage_chan("Dev2/ao0")
-    task.timing.cfg_samp_clk_timing(
-        SAMPLE_RATE,
-        sample_mode=nidaqmx.constants.AcquisitionType.FINITE,
-        samps_per_chan=num_timesteps,
-    )  # Hardware-timed
+if __name__ == "__main__":
+    player = TonePlayer("Dev2/ao0")
 
     # Play tone
-    task.write(tone_scaled, auto_start=True)
+    player.queue(make_tone(FREQUENCY, DURATION))
+    player.play()
+    player.wait()
 
-    # Stop the task
-    time.sleep(DURATION)  # Handles tone hanging
-    task.stop()
+    player.close()